@@ -0,0 +1,49 @@
+# Copyright 2020- Hiroshi Hatake
+
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+
+#     http://www.apache.org/licenses/LICENSE-2.0
+
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Compare "do I have X" checks for the current thread:
+#  * libcap-ng:  CapNG#caps_process + #have_capability?, which re-reads
+#    the capabilities through libcap-ng every time.
+#  * fresh:      CapNG.current_capability? after CapNG.refresh!, i.e.
+#    a single capget(2) (plus one read of /proc/thread-self/status for
+#    the bounding set).
+#  * memoized:   CapNG.current_capability? answered from the snapshot.
+
+require 'benchmark'
+require 'capng'
+
+n = Integer(ARGV[0] || 100_000)
+capng = CapNG.new
+
+Benchmark.bm(28) do |x|
+  [:effective, :bounding_set].each do |type|
+    x.report("libcap-ng (#{type})") do
+      n.times do
+        capng.caps_process
+        capng.have_capability?(type, :dac_read_search)
+      end
+    end
+    x.report("fresh (#{type})") do
+      n.times do
+        CapNG.refresh!
+        CapNG.current_capability?(type, :dac_read_search)
+      end
+    end
+    x.report("memoized (#{type})") do
+      n.times do
+        CapNG.current_capability?(type, :dac_read_search)
+      end
+    end
+  end
+end
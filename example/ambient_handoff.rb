@@ -0,0 +1,26 @@
+# Copyright 2020- Hiroshi Hatake
+
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+
+#     http://www.apache.org/licenses/LICENSE-2.0
+
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require 'capng'
+
+if Process.uid != 0
+  puts "Needed to run as root!"
+  exit 2
+end
+
+handoff = CapNG::AmbientHandoff.new([:net_bind_service, :dac_read_search])
+3.times do
+  pid = handoff.spawn("grep", "^CapAmb", "/proc/self/status")
+  Process.wait(pid)
+end
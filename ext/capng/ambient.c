@@ -0,0 +1,163 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+/* clang-format off */
+/*
+ * Document-class: CapNG::AmbientHandoff
+ *
+ * Hand capabilities down to child processes through the ambient set.
+ *
+ * The capability list is resolved once. #apply only issues capget(2),
+ * capset(2) and prctl(2), so it is cheap and safe to call in a freshly
+ * forked child right before exec.
+ *
+ * @example
+ *  require 'capng'
+ *
+ *  @handoff = CapNG::AmbientHandoff.new([:net_bind_service, :dac_read_search])
+ *  @handoff.spawn("fluentd", "--under-supervisor")
+ *  @handoff.fork { exec("ruby", "worker.rb") }
+ */
+/* clang-format on */
+
+#include <capng.h>
+
+#include <errno.h>
+
+struct CapNGAmbientHandoff
+{
+  uint64_t ambient;
+  int embedded;
+};
+
+static size_t
+capng_ambient_handoff_memsize(const void* ptr)
+{
+  const struct CapNGAmbientHandoff* handoff = (const struct CapNGAmbientHandoff*)ptr;
+
+  return handoff->embedded ? 0 : sizeof(struct CapNGAmbientHandoff);
+}
+
+static const rb_data_type_t rb_capng_ambient_handoff_type = {
+  "capng/ambient_handoff",
+  {
+    0,
+    RUBY_TYPED_DEFAULT_FREE,
+    capng_ambient_handoff_memsize,
+  },
+  NULL,
+  NULL,
+  RUBY_TYPED_FREE_IMMEDIATELY | CAPNG_TYPED_EMBEDDABLE
+};
+
+static VALUE
+rb_capng_ambient_handoff_alloc(VALUE klass)
+{
+  VALUE obj;
+  struct CapNGAmbientHandoff* handoff;
+  obj = TypedData_Make_Struct(
+    klass, struct CapNGAmbientHandoff, &rb_capng_ambient_handoff_type, handoff);
+  handoff->embedded = CAPNG_TYPED_EMBEDDED_P(obj);
+  return obj;
+}
+
+/*
+ * Initalize AmbientHandoff class.
+ *
+ * @param rb_capabilities [Array or Symbol or String or Fixnum]
+ *   Capability names or constants to be inherited by child processes.
+ * @return [nil]
+ *
+ */
+static VALUE
+rb_capng_ambient_handoff_initialize(VALUE self, VALUE rb_capabilities)
+{
+  struct CapNGAmbientHandoff* handoff;
+
+  TypedData_Get_Struct(
+    self, struct CapNGAmbientHandoff, &rb_capng_ambient_handoff_type, handoff);
+
+  handoff->ambient = value_to_capability_mask(rb_capabilities);
+
+  return Qnil;
+}
+
+/*
+ * Raise the prepared capabilities in the inheritable and ambient sets of
+ * the calling thread and clear any other ambient capability. They must be
+ * in the permitted set already.
+ *
+ * @return [Boolean]
+ *
+ */
+static VALUE
+rb_capng_ambient_handoff_apply(VALUE self)
+{
+  struct CapNGAmbientHandoff* handoff;
+  KernelCapabilities caps;
+
+  TypedData_Get_Struct(
+    self, struct CapNGAmbientHandoff, &rb_capng_ambient_handoff_type, handoff);
+
+  if (kernel_capget(0, &caps) != 0)
+    return Qfalse;
+
+  if ((caps.inheritable & handoff->ambient) != handoff->ambient) {
+    caps.inheritable |= handoff->ambient;
+    if (kernel_capset(&caps) != 0)
+      return Qfalse;
+    invalidate_applied_capabilities();
+  }
+
+  invalidate_current_capability_sets();
+  if (kernel_set_ambient(handoff->ambient) != 0) {
+    TRACE_RECORD(TRACE_AMBIENT_HANDOFF, 0, 0, 0, handoff->ambient, 0, -1, errno);
+    return Qfalse;
+  }
+  /* The ambient set differs from what a cached apply last put there. */
+  invalidate_applied_capabilities();
+  TRACE_RECORD(TRACE_AMBIENT_HANDOFF, 0, 0, 0, handoff->ambient, 0, 0, 0);
+
+  return Qtrue;
+}
+
+/*
+ * Obtain the prepared capabilities as a mask.
+ *
+ * @return [Integer]
+ *
+ */
+static VALUE
+rb_capng_ambient_handoff_mask(VALUE self)
+{
+  struct CapNGAmbientHandoff* handoff;
+
+  TypedData_Get_Struct(
+    self, struct CapNGAmbientHandoff, &rb_capng_ambient_handoff_type, handoff);
+
+  return ULL2NUM(handoff->ambient);
+}
+
+void
+Init_capng_ambient(VALUE rb_cCapNG)
+{
+  VALUE rb_cAmbientHandoff =
+    rb_define_class_under(rb_cCapNG, "AmbientHandoff", rb_cObject);
+
+  rb_define_alloc_func(rb_cAmbientHandoff, rb_capng_ambient_handoff_alloc);
+
+  rb_define_method(
+    rb_cAmbientHandoff, "initialize", rb_capng_ambient_handoff_initialize, 1);
+  rb_define_method(rb_cAmbientHandoff, "apply", rb_capng_ambient_handoff_apply, 0);
+  rb_define_method(rb_cAmbientHandoff, "mask", rb_capng_ambient_handoff_mask, 0);
+}
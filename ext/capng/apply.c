@@ -0,0 +1,209 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+#include <capng.h>
+
+/* Capabilities are a per-thread attribute in Linux and libcap-ng keeps its
+ * working state per thread as well, so the last applied sets and the
+ * statistics are tracked per thread, too. Applying to every thread at
+ * once bumps a process wide generation instead, since other threads'
+ * records can't be reached. */
+struct AppliedCapabilities
+{
+  unsigned long generation;
+  int caps_valid;
+  int bounds_valid;
+  int ambient_valid;
+  uint64_t effective;
+  uint64_t permitted;
+  uint64_t inheritable;
+  uint64_t bounding;
+  uint64_t ambient;
+};
+
+struct ApplyStats
+{
+  unsigned long caps_applied;
+  unsigned long caps_elided;
+  unsigned long bounds_applied;
+  unsigned long bounds_elided;
+  unsigned long ambient_applied;
+  unsigned long ambient_elided;
+};
+
+static unsigned long applied_generation = 1;
+static __thread struct AppliedCapabilities applied;
+static __thread struct ApplyStats stats;
+
+/*
+ * Apply the selected sets of the libcap-ng state, skipping the sets which
+ * are identical to the ones this thread applied last time.
+ */
+int
+apply_capabilities(capng_select_t select)
+{
+  capng_select_t pending = 0;
+  uint64_t effective = 0, permitted = 0, inheritable = 0, bounding = 0, ambient = 0;
+  int result = 0;
+
+  if (applied.generation != __atomic_load_n(&applied_generation, __ATOMIC_ACQUIRE)) {
+    invalidate_applied_capabilities();
+    applied.generation = __atomic_load_n(&applied_generation, __ATOMIC_ACQUIRE);
+  }
+
+  if (select & CAPNG_SELECT_CAPS) {
+    effective = capability_mask(CAPNG_EFFECTIVE);
+    permitted = capability_mask(CAPNG_PERMITTED);
+    inheritable = capability_mask(CAPNG_INHERITABLE);
+    if (applied.caps_valid && applied.effective == effective &&
+        applied.permitted == permitted && applied.inheritable == inheritable) {
+      stats.caps_elided++;
+    } else {
+      pending |= CAPNG_SELECT_CAPS;
+    }
+  }
+
+  if (select & CAPNG_SELECT_BOUNDS) {
+    bounding = capability_mask(CAPNG_BOUNDING_SET);
+    if (applied.bounds_valid && applied.bounding == bounding) {
+      stats.bounds_elided++;
+    } else {
+      pending |= CAPNG_SELECT_BOUNDS;
+    }
+  }
+
+#if defined(HAVE_CONST_CAPNG_SELECT_AMBIENT) && defined(HAVE_CONST_CAPNG_AMBIENT)
+  if (select & CAPNG_SELECT_AMBIENT) {
+    ambient = capability_mask(CAPNG_AMBIENT);
+    if (applied.ambient_valid && applied.ambient == ambient) {
+      stats.ambient_elided++;
+    } else {
+      pending |= CAPNG_SELECT_AMBIENT;
+    }
+  }
+#endif
+
+  if (!pending) {
+    TRACE_RECORD(TRACE_APPLY,
+                 select,
+                 0,
+                 0,
+                 capability_mask(CAPNG_EFFECTIVE),
+                 capability_mask(CAPNG_PERMITTED),
+                 0,
+                 0);
+    return 0;
+  }
+
+  result = capng_apply(pending);
+  TRACE_RECORD(TRACE_APPLY,
+               select,
+               pending,
+               0,
+               capability_mask(CAPNG_EFFECTIVE),
+               capability_mask(CAPNG_PERMITTED),
+               result,
+               result ? errno : 0);
+  invalidate_current_capability_sets();
+  if (result != 0) {
+    /* A partially applied state is unknown to us. */
+    invalidate_applied_capabilities();
+    return result;
+  }
+
+  if (pending & CAPNG_SELECT_CAPS) {
+    applied.caps_valid = 1;
+    applied.effective = effective;
+    applied.permitted = permitted;
+    applied.inheritable = inheritable;
+    stats.caps_applied++;
+  }
+  if (pending & CAPNG_SELECT_BOUNDS) {
+    applied.bounds_valid = 1;
+    applied.bounding = bounding;
+    stats.bounds_applied++;
+  }
+#if defined(HAVE_CONST_CAPNG_SELECT_AMBIENT) && defined(HAVE_CONST_CAPNG_AMBIENT)
+  if (pending & CAPNG_SELECT_AMBIENT) {
+    applied.ambient_valid = 1;
+    applied.ambient = ambient;
+    stats.ambient_applied++;
+  }
+#endif
+
+  return result;
+}
+
+void
+invalidate_applied_capabilities(void)
+{
+  applied.caps_valid = 0;
+  applied.bounds_valid = 0;
+  applied.ambient_valid = 0;
+}
+
+void
+invalidate_applied_capabilities_all_threads(void)
+{
+  __atomic_add_fetch(&applied_generation, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Obtain how many apply operations reached the kernel or were elided on
+ * the calling thread.
+ *
+ * @return [Hash]
+ *
+ */
+static VALUE
+rb_capng_s_apply_stats(VALUE self)
+{
+  VALUE result = rb_hash_new();
+
+  rb_hash_aset(result, ID2SYM(rb_intern("caps_applied")), ULONG2NUM(stats.caps_applied));
+  rb_hash_aset(result, ID2SYM(rb_intern("caps_elided")), ULONG2NUM(stats.caps_elided));
+  rb_hash_aset(
+    result, ID2SYM(rb_intern("bounds_applied")), ULONG2NUM(stats.bounds_applied));
+  rb_hash_aset(
+    result, ID2SYM(rb_intern("bounds_elided")), ULONG2NUM(stats.bounds_elided));
+  rb_hash_aset(
+    result, ID2SYM(rb_intern("ambient_applied")), ULONG2NUM(stats.ambient_applied));
+  rb_hash_aset(
+    result, ID2SYM(rb_intern("ambient_elided")), ULONG2NUM(stats.ambient_elided));
+
+  return result;
+}
+
+/*
+ * Forget the capability sets applied last time on the calling thread.
+ * Call this after changing capabilities without CapNG, e.g. with
+ * Process::Sys.setuid, so that the next #apply reaches the kernel.
+ *
+ * @return [nil]
+ *
+ */
+static VALUE
+rb_capng_s_clear_apply_cache(VALUE self)
+{
+  invalidate_applied_capabilities();
+
+  return Qnil;
+}
+
+void
+Init_capng_apply(VALUE rb_cCapNG)
+{
+  rb_define_singleton_method(rb_cCapNG, "apply_stats", rb_capng_s_apply_stats, 0);
+  rb_define_singleton_method(
+    rb_cCapNG, "clear_apply_cache", rb_capng_s_clear_apply_cache, 0);
+}
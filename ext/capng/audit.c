@@ -0,0 +1,397 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+
+/* Streaming NDJSON audit of process and file capabilities.
+ *
+ * Records are formatted into a fixed scratch area and appended to one
+ * output buffer, which is reused whenever it fills up. The IO is given a
+ * fresh copy each time, since it may keep the String. Memory use therefore
+ * depends on the buffer size only, never on the number of processes or
+ * files. */
+
+#include <capng.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#define AUDIT_DEFAULT_BUFFER_SIZE 65536
+#define AUDIT_MIN_BUFFER_SIZE 4096
+#define AUDIT_RECORD_SIZE 32768
+#define AUDIT_MAX_DEPTH 128
+
+struct CapNGAudit
+{
+  VALUE io;
+  VALUE buffer;
+  long capacity;
+  long records;
+  char* record;
+  size_t length;
+  int overflow;
+  DIR* dirs[AUDIT_MAX_DEPTH];
+  int depth;
+  char path[PATH_MAX];
+};
+
+static void
+audit_append(struct CapNGAudit* audit, const char* data, size_t size)
+{
+  if (audit->overflow || audit->length + size >= AUDIT_RECORD_SIZE) {
+    audit->overflow = 1;
+    return;
+  }
+  memcpy(audit->record + audit->length, data, size);
+  audit->length += size;
+}
+
+static void
+audit_append_cstr(struct CapNGAudit* audit, const char* str)
+{
+  audit_append(audit, str, strlen(str));
+}
+
+static void
+audit_append_uint(struct CapNGAudit* audit, unsigned long long value)
+{
+  char digits[24];
+  int len = snprintf(digits, sizeof(digits), "%llu", value);
+
+  audit_append(audit, digits, (size_t)len);
+}
+
+static void
+audit_append_json_string(struct CapNGAudit* audit, const char* str)
+{
+  static const char hex[] = "0123456789abcdef";
+
+  audit_append(audit, "\"", 1);
+  for (const unsigned char* p = (const unsigned char*)str; *p; p++) {
+    if (*p == '"' || *p == '\\') {
+      char escaped[2] = { '\\', (char)*p };
+      audit_append(audit, escaped, 2);
+    } else if (*p < 0x20) {
+      char escaped[6] = { '\\', 'u', '0', '0', hex[*p >> 4], hex[*p & 0xf] };
+      audit_append(audit, escaped, 6);
+    } else {
+      audit_append(audit, (const char*)p, 1);
+    }
+  }
+  audit_append(audit, "\"", 1);
+}
+
+static void
+audit_append_mask(struct CapNGAudit* audit, const char* key, uint64_t mask)
+{
+  audit_append(audit, ",\"", 2);
+  audit_append_cstr(audit, key);
+  audit_append(audit, "\":", 2);
+  audit_append_uint(audit, mask);
+}
+
+static void
+audit_append_names(struct CapNGAudit* audit, const char* key, uint64_t mask)
+{
+  int first = 1;
+
+  audit_append(audit, ",\"", 2);
+  audit_append_cstr(audit, key);
+  audit_append(audit, "_names\":[", 9);
+  for (unsigned int i = 0; i <= CAPNG_C_LAST_CAP; i++) {
+    const char* name = NULL;
+    if (!(mask & CAPNG_C_MASK(i)))
+      continue;
+    name = capability_name(i);
+    if (!name)
+      continue;
+    if (!first)
+      audit_append(audit, ",", 1);
+    audit_append_json_string(audit, name);
+    first = 0;
+  }
+  audit_append(audit, "]", 1);
+}
+
+static void
+audit_flush(struct CapNGAudit* audit)
+{
+  if (RSTRING_LEN(audit->buffer) == 0)
+    return;
+  rb_io_write(audit->io,
+              rb_str_new(RSTRING_PTR(audit->buffer), RSTRING_LEN(audit->buffer)));
+  rb_str_set_len(audit->buffer, 0);
+}
+
+static void
+audit_emit(struct CapNGAudit* audit)
+{
+  if (audit->overflow) {
+    audit->length = 0;
+    audit->overflow = 0;
+    return;
+  }
+
+  audit->record[audit->length++] = '\n';
+  if (RSTRING_LEN(audit->buffer) + (long)audit->length > audit->capacity)
+    audit_flush(audit);
+  rb_str_cat(audit->buffer, audit->record, (long)audit->length);
+  audit->length = 0;
+  audit->records++;
+}
+
+static void
+audit_process(struct CapNGAudit* audit, int pid)
+{
+  char path[64];
+  char buffer[PROC_STATUS_BUFFER_SIZE];
+  ProcStatus status;
+
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  if (read_proc_status(path, &status, buffer, sizeof(buffer)) != 0 ||
+      !(status.found & PROC_STATUS_EFFECTIVE))
+    return;
+
+  audit_append_cstr(audit, "{\"type\":\"process\",\"pid\":");
+  audit_append_uint(audit, (unsigned long long)pid);
+  audit_append_cstr(audit, ",\"name\":");
+  audit_append_json_string(audit, status.name);
+  audit_append_cstr(audit, ",\"uid\":");
+  audit_append_uint(audit, (unsigned long long)status.uid);
+  audit_append_mask(audit, "effective", status.sets.effective);
+  audit_append_mask(audit, "permitted", status.sets.permitted);
+  audit_append_mask(audit, "inheritable", status.sets.inheritable);
+  audit_append_mask(audit, "bounding", status.sets.bounding);
+  audit_append_mask(audit, "ambient", status.sets.ambient);
+  audit_append_names(audit, "effective", status.sets.effective);
+  audit_append_names(audit, "permitted", status.sets.permitted);
+  audit_append_names(audit, "inheritable", status.sets.inheritable);
+  audit_append_names(audit, "bounding", status.sets.bounding);
+  audit_append_names(audit, "ambient", status.sets.ambient);
+  audit_append(audit, "}", 1);
+  audit_emit(audit);
+}
+
+static void
+audit_processes(struct CapNGAudit* audit)
+{
+  DIR* dir = opendir("/proc");
+  struct dirent* entry = NULL;
+
+  if (!dir)
+    rb_sys_fail("/proc");
+  audit->dirs[audit->depth++] = dir;
+
+  while ((entry = readdir(dir)) != NULL) {
+    char* end = NULL;
+    long pid = strtol(entry->d_name, &end, 10);
+    if (*end != '\0' || pid <= 0)
+      continue;
+    audit_process(audit, (int)pid);
+  }
+
+  audit->dirs[--audit->depth] = NULL;
+  closedir(dir);
+}
+
+static void
+audit_file(struct CapNGAudit* audit, const struct stat* st)
+{
+  FileCapabilities caps;
+
+  if (read_file_capabilities(audit->path, 0, &caps) != 0)
+    return;
+
+  audit_append_cstr(audit, "{\"type\":\"file\",\"path\":");
+  audit_append_json_string(audit, audit->path);
+  audit_append_cstr(audit, ",\"inode\":");
+  audit_append_uint(audit, (unsigned long long)st->st_ino);
+  audit_append_cstr(audit, ",\"version\":");
+  audit_append_uint(audit, (unsigned long long)caps.version);
+  audit_append_cstr(audit, caps.effective ? ",\"effective\":true" : ",\"effective\":false");
+  audit_append_mask(audit, "permitted", caps.permitted);
+  audit_append_mask(audit, "inheritable", caps.inheritable);
+  /* Only version 3 xattrs carry a root id; 0 is a valid one. */
+  if (caps.version == FILE_CAPS_REVISION_3)
+    audit_append_mask(audit, "rootid", caps.rootid);
+  else
+    audit_append_cstr(audit, ",\"rootid\":null");
+  audit_append_names(audit, "permitted", caps.permitted);
+  audit_append_names(audit, "inheritable", caps.inheritable);
+  audit_append(audit, "}", 1);
+  audit_emit(audit);
+}
+
+/* audit->path holds the entry to visit; it is restored before returning. */
+static void
+audit_walk(struct CapNGAudit* audit)
+{
+  struct stat st;
+  struct dirent* entry = NULL;
+  DIR* dir = NULL;
+  size_t length = strlen(audit->path);
+
+  if (lstat(audit->path, &st) != 0)
+    return;
+  if (S_ISREG(st.st_mode)) {
+    audit_file(audit, &st);
+    return;
+  }
+  if (!S_ISDIR(st.st_mode) || audit->depth >= AUDIT_MAX_DEPTH)
+    return;
+
+  dir = opendir(audit->path);
+  if (!dir)
+    return;
+  audit->dirs[audit->depth++] = dir;
+  rb_thread_check_ints();
+
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_REG && entry->d_type != DT_DIR)
+      continue;
+    if (length + 1 + strlen(entry->d_name) >= sizeof(audit->path))
+      continue;
+    if (length == 0 || audit->path[length - 1] != '/')
+      snprintf(audit->path + length, sizeof(audit->path) - length, "/%s", entry->d_name);
+    else
+      snprintf(audit->path + length, sizeof(audit->path) - length, "%s", entry->d_name);
+    audit_walk(audit);
+    audit->path[length] = '\0';
+  }
+
+  audit->dirs[--audit->depth] = NULL;
+  closedir(dir);
+}
+
+struct CapNGAuditArgs
+{
+  struct CapNGAudit* audit;
+  int processes;
+  VALUE paths;
+};
+
+static VALUE
+audit_perform(VALUE arg)
+{
+  struct CapNGAuditArgs* args = (struct CapNGAuditArgs*)arg;
+  struct CapNGAudit* audit = args->audit;
+
+  if (args->processes)
+    audit_processes(audit);
+  for (long i = 0; i < RARRAY_LEN(args->paths); i++) {
+    VALUE rb_path = RARRAY_AREF(args->paths, i);
+    if (RSTRING_LEN(rb_path) >= (long)sizeof(audit->path))
+      continue;
+    snprintf(audit->path, sizeof(audit->path), "%s", StringValueCStr(rb_path));
+    audit_walk(audit);
+  }
+  audit_flush(audit);
+
+  return LONG2NUM(audit->records);
+}
+
+static VALUE
+audit_release(VALUE arg)
+{
+  struct CapNGAudit* audit = (struct CapNGAudit*)arg;
+
+  while (audit->depth > 0) {
+    closedir(audit->dirs[--audit->depth]);
+  }
+  xfree(audit->record);
+  xfree(audit);
+
+  return Qnil;
+}
+
+/*
+ * Write capabilities of every process and of every file capability under
+ * the given paths to an IO as newline delimited JSON.
+ *
+ * Records are streamed through a fixed size buffer, so memory use does not
+ * grow with the number of processes or files. Symbolic links are not
+ * followed while walking paths.
+ *
+ * @overload audit(io, processes: true, paths: [], buffer_size: 65536)
+ *   @param io [IO] Destination. It receives Strings through #write.
+ *   @param processes [Boolean] Whether to emit a record per process.
+ *   @param paths [Array<String>] Files or directories walked for file capabilities.
+ *   @param buffer_size [Integer] Bytes buffered before each write.
+ *
+ * @example
+ *  CapNG.audit($stdout, paths: ["/usr/bin"])
+ *  # {"type":"process","pid":1,"name":"systemd","uid":0,"effective":2199023255551,...}
+ *  # {"type":"file","path":"/usr/bin/ping","inode":1234,"version":2,"effective":true,...}
+ *
+ * @return [Integer] The number of records written.
+ *
+ */
+static VALUE
+rb_capng_s_audit(int argc, VALUE* argv, VALUE self)
+{
+  static ID keyword_ids[3];
+  VALUE rb_io, rb_options, kwargs[3];
+  VALUE rb_paths = rb_ary_new();
+  VALUE rb_buffer = Qnil, rb_result = Qnil;
+  struct CapNGAuditArgs args;
+  struct CapNGAudit* audit = NULL;
+  long capacity = AUDIT_DEFAULT_BUFFER_SIZE;
+
+  if (!keyword_ids[0]) {
+    keyword_ids[0] = rb_intern("processes");
+    keyword_ids[1] = rb_intern("paths");
+    keyword_ids[2] = rb_intern("buffer_size");
+  }
+
+  rb_scan_args(argc, argv, "1:", &rb_io, &rb_options);
+  rb_get_kwargs(rb_options, keyword_ids, 0, 3, kwargs);
+
+  args.processes = kwargs[0] == Qundef ? 1 : RTEST(kwargs[0]);
+  if (kwargs[1] != Qundef && !NIL_P(kwargs[1])) {
+    VALUE rb_given = rb_Array(kwargs[1]);
+    for (long i = 0; i < RARRAY_LEN(rb_given); i++) {
+      VALUE rb_path = RARRAY_AREF(rb_given, i);
+      FilePathValue(rb_path);
+      rb_ary_push(rb_paths, rb_str_new_frozen(rb_path));
+    }
+  }
+  if (kwargs[2] != Qundef && !NIL_P(kwargs[2]))
+    capacity = NUM2LONG(kwargs[2]);
+  if (capacity < AUDIT_MIN_BUFFER_SIZE)
+    capacity = AUDIT_MIN_BUFFER_SIZE;
+
+  rb_buffer = rb_str_buf_new(capacity);
+  audit = ZALLOC(struct CapNGAudit);
+  audit->io = rb_io;
+  audit->buffer = rb_buffer;
+  audit->capacity = capacity;
+  audit->record = ALLOC_N(char, AUDIT_RECORD_SIZE);
+  args.audit = audit;
+  args.paths = rb_paths;
+
+  rb_result = rb_ensure(audit_perform, (VALUE)&args, audit_release, (VALUE)audit);
+  RB_GC_GUARD(rb_io);
+  RB_GC_GUARD(rb_buffer);
+  RB_GC_GUARD(rb_paths);
+
+  return rb_result;
+}
+
+void
+Init_capng_audit(VALUE rb_cCapNG)
+{
+  rb_define_singleton_method(rb_cCapNG, "audit", rb_capng_s_audit, -1);
+}
@@ -0,0 +1,448 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+
+/* Applying capabilities to every thread of the process.
+ *
+ * capset(2) and the bounding/ambient prctl(2) calls only change the
+ * calling thread. Like glibc does for setuid(2), every other thread of
+ * the process is sent a signal whose handler applies the same sets with
+ * raw syscalls and reports the outcome through a shared slot. The
+ * directory of tasks is read again until no new thread shows up. The
+ * caller polls the slots without the GVL and gives up on the threads which
+ * haven't answered by a single deadline.
+ *
+ * The handler stays installed once used: a late signal delivered after
+ * restoring SIG_DFL would kill the process. It is never installed over a
+ * handler somebody else put on the signal. */
+
+#include <capng.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <ruby/thread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BROADCAST_DIRENT_BATCH_SIZE 8192
+#define BROADCAST_MAX_PASSES 8
+#define BROADCAST_TIMEOUT_NSEC 1000000000L
+#define BROADCAST_POLL_NSEC 100000L
+#define BROADCAST_SIGNAL (SIGRTMAX - 2)
+
+#define BROADCAST_SLOT_PENDING 0
+#define BROADCAST_SLOT_DONE 1
+
+struct CapNGBroadcastSlot
+{
+  int tid;
+  int state;
+  int error;
+};
+
+struct CapNGBroadcastTable
+{
+  size_t nslots;
+  struct CapNGBroadcastSlot slots[];
+};
+
+struct CapNGBroadcastTarget
+{
+  capng_select_t select;
+  KernelCapabilities caps;
+  uint64_t bounding;
+  uint64_t ambient;
+};
+
+struct CapNGBroadcastRun
+{
+  struct CapNGBroadcastTarget target;
+  int fd;
+  char* dirents;
+  struct CapNGBroadcastTable* table;
+  int self_error;
+  int error;
+  int foreign_handler;
+};
+
+/* One broadcast at a time per process, whichever Ractor starts it. */
+static pthread_mutex_t broadcast_lock = PTHREAD_MUTEX_INITIALIZER;
+static int broadcast_handler_installed;
+static struct CapNGBroadcastTarget broadcast_target;
+/* Published to the handler; swapped to NULL and drained of running
+ * handlers before it is resized or freed. */
+static struct CapNGBroadcastTable* broadcast_table;
+static int broadcast_running_handlers;
+
+static int
+capng_broadcast_apply_target(const struct CapNGBroadcastTarget* target)
+{
+  /* The same order as capng_apply(): the bounding set needs CAP_SETPCAP,
+   * which the new effective set may not have anymore. */
+  if ((target->select & CAPNG_SELECT_BOUNDS) && kernel_drop_bounding(target->bounding) != 0)
+    return errno;
+  if ((target->select & CAPNG_SELECT_CAPS) && kernel_capset(&target->caps) != 0)
+    return errno;
+#if defined(HAVE_CONST_CAPNG_SELECT_AMBIENT)
+  if ((target->select & CAPNG_SELECT_AMBIENT) && kernel_set_ambient(target->ambient) != 0)
+    return errno;
+#endif
+
+  return 0;
+}
+
+/* Only async-signal-safe calls here. */
+static void
+capng_broadcast_handler(int signo, siginfo_t* info, void* context)
+{
+  int saved_errno = errno;
+  struct CapNGBroadcastTable* table = NULL;
+
+  __atomic_add_fetch(&broadcast_running_handlers, 1, __ATOMIC_SEQ_CST);
+  table = __atomic_load_n(&broadcast_table, __ATOMIC_SEQ_CST);
+  if (table && info->si_code == SI_TKILL && info->si_pid == getpid()) {
+    int tid = kernel_gettid();
+
+    for (size_t i = 0; i < table->nslots; i++) {
+      struct CapNGBroadcastSlot* slot = &table->slots[i];
+
+      if (slot->tid != tid ||
+          __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == BROADCAST_SLOT_DONE)
+        continue;
+      slot->error = capng_broadcast_apply_target(&broadcast_target);
+      __atomic_store_n(&slot->state, BROADCAST_SLOT_DONE, __ATOMIC_RELEASE);
+      break;
+    }
+  }
+  __atomic_sub_fetch(&broadcast_running_handlers, 1, __ATOMIC_SEQ_CST);
+
+  errno = saved_errno;
+}
+
+static void
+capng_broadcast_unpublish(void)
+{
+  __atomic_store_n(&broadcast_table, NULL, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&broadcast_running_handlers, __ATOMIC_SEQ_CST) > 0)
+    sched_yield();
+}
+
+static int
+capng_broadcast_has_tid(const struct CapNGBroadcastTable* table, int tid)
+{
+  for (size_t i = 0; table && i < table->nslots; i++) {
+    if (table->slots[i].tid == tid)
+      return 1;
+  }
+
+  return 0;
+}
+
+/* Append the tasks which are not in the table yet. Returns how many were
+ * added, or -1 with errno. */
+static long
+capng_broadcast_collect(int fd, char* dirents, int self, struct CapNGBroadcastTable** table)
+{
+  long added = 0;
+  long n = 0;
+
+  if (lseek(fd, 0, SEEK_SET) != 0)
+    return -1;
+
+  while ((n = syscall(SYS_getdents64, fd, dirents, BROADCAST_DIRENT_BATCH_SIZE)) > 0) {
+    for (long offset = 0; offset < n;) {
+      struct CapNGDirent64* entry = (struct CapNGDirent64*)(dirents + offset);
+      struct CapNGBroadcastTable* grown = NULL;
+      size_t nslots = *table ? (*table)->nslots : 0;
+      char* end = NULL;
+      long tid = 0;
+
+      offset += entry->d_reclen;
+      tid = strtol(entry->d_name, &end, 10);
+      if (*end != '\0' || tid <= 0 || tid == self || capng_broadcast_has_tid(*table, (int)tid))
+        continue;
+
+      grown = realloc(*table, sizeof(*grown) + (nslots + 1) * sizeof(grown->slots[0]));
+      if (!grown)
+        return -1;
+      grown->nslots = nslots + 1;
+      grown->slots[nslots].tid = (int)tid;
+      grown->slots[nslots].state = BROADCAST_SLOT_PENDING;
+      grown->slots[nslots].error = 0;
+      *table = grown;
+      added++;
+    }
+  }
+
+  return n < 0 ? -1 : added;
+}
+
+static long
+capng_broadcast_elapsed_nsec(const struct timespec* start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - start->tv_sec) * 1000000000L + (now.tv_nsec - start->tv_nsec);
+}
+
+/* Install the handler unless the signal already has one of its own.
+ * Returns 0, 1 for a foreign handler, or -1 with errno. */
+static int
+capng_broadcast_install_handler(void)
+{
+  struct sigaction action, old_action;
+
+  if (broadcast_handler_installed)
+    return 0;
+
+  if (sigaction(BROADCAST_SIGNAL, NULL, &old_action) != 0)
+    return -1;
+  if ((old_action.sa_flags & SA_SIGINFO) ||
+      (old_action.sa_handler != SIG_DFL && old_action.sa_handler != SIG_IGN))
+    return 1;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = capng_broadcast_handler;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(BROADCAST_SIGNAL, &action, NULL) != 0)
+    return -1;
+  broadcast_handler_installed = 1;
+
+  return 0;
+}
+
+/*
+ * Signal every other thread and wait for them to apply the target.
+ * Returns 0, or an errno when the broadcast couldn't be set up at all.
+ */
+static int
+capng_broadcast_run(int fd, char* dirents, struct CapNGBroadcastTable** result, int* self_error)
+{
+  static const struct timespec poll_interval = { 0, BROADCAST_POLL_NSEC };
+  struct CapNGBroadcastTable* table = NULL;
+  struct timespec start;
+  pid_t pid = getpid();
+  int self = kernel_gettid();
+  int error = 0;
+
+  /* One deadline for all passes: a thread which never answers costs it
+   * once, and is only ever signalled in the pass which found it. */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int pass = 0; pass < BROADCAST_MAX_PASSES; pass++) {
+    size_t first = table ? table->nslots : 0;
+    long added = 0;
+    int pending = 0;
+
+    capng_broadcast_unpublish();
+    added = capng_broadcast_collect(fd, dirents, self, &table);
+    if (added < 0) {
+      error = errno;
+      break;
+    }
+    if (added == 0)
+      break;
+    __atomic_store_n(&broadcast_table, table, __ATOMIC_SEQ_CST);
+
+    for (size_t i = first; i < table->nslots; i++) {
+      if (syscall(SYS_tgkill, pid, table->slots[i].tid, BROADCAST_SIGNAL) != 0) {
+        table->slots[i].error = errno;
+        __atomic_store_n(&table->slots[i].state, BROADCAST_SLOT_DONE, __ATOMIC_RELEASE);
+      }
+    }
+
+    while (1) {
+      pending = 0;
+      for (size_t i = first; i < table->nslots; i++) {
+        if (__atomic_load_n(&table->slots[i].state, __ATOMIC_ACQUIRE) != BROADCAST_SLOT_DONE)
+          pending++;
+      }
+      if (!pending || capng_broadcast_elapsed_nsec(&start) >= BROADCAST_TIMEOUT_NSEC)
+        break;
+      nanosleep(&poll_interval, NULL);
+    }
+    if (pending)
+      break;
+  }
+
+  capng_broadcast_unpublish();
+  for (size_t i = 0; table && i < table->nslots; i++) {
+    if (table->slots[i].state != BROADCAST_SLOT_DONE)
+      table->slots[i].error = ETIMEDOUT;
+  }
+
+  if (!error)
+    *self_error = capng_broadcast_apply_target(&broadcast_target);
+  *result = table;
+
+  return error;
+}
+
+static void*
+capng_broadcast_run_without_gvl(void* ptr)
+{
+  struct CapNGBroadcastRun* run = (struct CapNGBroadcastRun*)ptr;
+  int installed = 0;
+
+  pthread_mutex_lock(&broadcast_lock);
+  installed = capng_broadcast_install_handler();
+  if (installed < 0)
+    run->error = errno;
+  else if (installed > 0)
+    run->foreign_handler = 1;
+  else {
+    broadcast_target = run->target;
+    run->error = capng_broadcast_run(run->fd, run->dirents, &run->table, &run->self_error);
+  }
+  pthread_mutex_unlock(&broadcast_lock);
+
+  return NULL;
+}
+
+/*
+ * Apply the selected sets to every thread of the process, not only the
+ * calling one. Other threads are interrupted with a real-time signal
+ * (SIGRTMAX - 2), so it must not be used for anything else.
+ *
+ * Threads which block the signal don't answer within a second in total and
+ * are reported as :timeout; threads which exit meanwhile as :esrch.
+ *
+ * @overload apply_all_threads(select = :caps)
+ *   @param select [Symbol, String, Integer] :caps, :bounds, :both or :all.
+ *
+ * @raise [RuntimeError] The signal already has a handler of its own.
+ * @raise [SystemCallError] The threads couldn't be listed or signalled.
+ *
+ * @return [Hash{Integer => Symbol}] Outcome per thread id: :ok or an
+ *   errno name like :eperm.
+ *
+ */
+static VALUE
+rb_capng_apply_all_threads(int argc, VALUE* argv, VALUE self)
+{
+  VALUE rb_select_name_or_enum = Qnil;
+  VALUE rb_result;
+  struct CapNGBroadcastRun run;
+  struct CapNGBroadcastTable* table = NULL;
+  struct CapNGBroadcastTarget target;
+  capng_select_t select = CAPNG_SELECT_CAPS;
+  int error = 0;
+  int self_error = 0;
+
+  rb_scan_args(argc, argv, "01", &rb_select_name_or_enum);
+  switch (TYPE(rb_select_name_or_enum)) {
+    case T_NIL:
+      break;
+    case T_SYMBOL:
+      select =
+        select_name_to_select_type(RSTRING_PTR(rb_sym2str(rb_select_name_or_enum)));
+      break;
+    case T_STRING:
+      select = select_name_to_select_type(StringValuePtr(rb_select_name_or_enum));
+      break;
+    case T_FIXNUM:
+      select = NUM2INT(rb_select_name_or_enum);
+      break;
+    default:
+      rb_raise(rb_eArgError,
+               "Expected a String or a Symbol instance, or a capability type constant");
+  }
+
+  memset(&run, 0, sizeof(run));
+  run.fd = open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (run.fd < 0)
+    rb_sys_fail("/proc/self/task");
+  run.dirents = malloc(BROADCAST_DIRENT_BATCH_SIZE);
+  if (!run.dirents) {
+    close(run.fd);
+    rb_memerror();
+  }
+
+  memset(&target, 0, sizeof(target));
+  ractor_state_enter();
+  target.select = select;
+  target.caps.effective = capability_mask(CAPNG_EFFECTIVE);
+  target.caps.permitted = capability_mask(CAPNG_PERMITTED);
+  target.caps.inheritable = capability_mask(CAPNG_INHERITABLE);
+  target.bounding = capability_mask(CAPNG_BOUNDING_SET);
+#if defined(HAVE_CONST_CAPNG_SELECT_AMBIENT) && defined(HAVE_CONST_CAPNG_AMBIENT)
+  target.ambient = capability_mask(CAPNG_AMBIENT);
+#endif
+  ractor_state_leave();
+
+  run.target = target;
+  /* Nothing below touches Ruby objects, and the signalled threads may be
+   * waiting for the GVL themselves. The wait is bounded, so there is no
+   * unblocking function. */
+  rb_thread_call_without_gvl(capng_broadcast_run_without_gvl, &run, NULL, NULL);
+  close(run.fd);
+  free(run.dirents);
+  table = run.table;
+  error = run.error;
+  self_error = run.self_error;
+  if (run.foreign_handler) {
+    rb_raise(rb_eRuntimeError,
+             "Signal %d already has a handler, apply_all_threads needs it",
+             BROADCAST_SIGNAL);
+  }
+
+  invalidate_applied_capabilities_all_threads();
+  invalidate_current_capability_sets();
+
+  if (__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED)) {
+    int failed = self_error ? 1 : 0;
+
+    for (size_t i = 0; table && i < table->nslots; i++) {
+      if (table->slots[i].error)
+        failed++;
+    }
+    trace_record(TRACE_APPLY_ALL_THREADS,
+                 select,
+                 (int)(table ? table->nslots : 0) + 1,
+                 failed,
+                 target.caps.effective,
+                 target.caps.permitted,
+                 error ? -1 : 0,
+                 error);
+  }
+
+  if (error) {
+    free(table);
+    rb_syserr_fail(error, "apply_all_threads");
+  }
+
+  rb_result = rb_hash_new();
+  rb_hash_aset(rb_result, INT2NUM(kernel_gettid()), capng_status_from_errno(self_error));
+  for (size_t i = 0; table && i < table->nslots; i++) {
+    rb_hash_aset(
+      rb_result, INT2NUM(table->slots[i].tid), capng_status_from_errno(table->slots[i].error));
+  }
+  free(table);
+
+  return rb_result;
+}
+
+void
+Init_capng_broadcast(VALUE rb_cCapNG)
+{
+  rb_define_method(rb_cCapNG, "apply_all_threads", rb_capng_apply_all_threads, -1);
+  rb_define_singleton_method(
+    rb_cCapNG, "apply_all_threads", rb_capng_apply_all_threads, -1);
+}
@@ -29,36 +29,21 @@
  */
 /* clang-format on */
 
-struct CapNGCapability
-{};
-
-static void
-capng_capability_free(void* capng);
-
 static const rb_data_type_t rb_capng_capability_type = { "capng_capability/c_runtime",
                                                          {
                                                            0,
-                                                           capng_capability_free,
+                                                           0,
                                                            0,
                                                          },
                                                          NULL,
                                                          NULL,
                                                          RUBY_TYPED_FREE_IMMEDIATELY };
 
-static void
-capng_capability_free(void* ptr)
-{
-  xfree(ptr);
-}
-
 static VALUE
 rb_capng_capability_alloc(VALUE klass)
 {
-  VALUE obj;
-  struct CapNGCapability* capng_capability;
-  obj = TypedData_Make_Struct(
-    klass, struct CapNGCapability, &rb_capng_capability_type, capng_capability);
-  return obj;
+  /* No per-object state, so don't allocate any. */
+  return TypedData_Wrap_Struct(klass, &rb_capng_capability_type, NULL);
 }
 
 /*
@@ -138,6 +123,69 @@ rb_capng_capability_each(VALUE self)
   return Qnil;
 }
 
+/*
+ * Build a capability bit mask from capability names or constants.
+ *
+ * @param rb_capabilities [Array] Capability names (String or Symbol) or constants.
+ *   Arrays are expanded.
+ * @return [Integer] Pass it as {mask: Integer} where capabilities are
+ *   expected, since a bare Integer is a capability constant there.
+ *
+ * @example
+ *  CapNG::Capability.mask(:chown, :kill) #=> 33
+ */
+static VALUE
+rb_capng_capability_s_mask(int argc, VALUE* argv, VALUE self)
+{
+  uint64_t mask = 0;
+
+  for (int i = 0; i < argc; i++) {
+    mask |= value_to_capability_mask(argv[i]);
+  }
+
+  return ULL2NUM(mask);
+}
+
+/*
+ * Parse libcap's textual representation of capabilities, as accepted by
+ * setcap(8), into masks.
+ *
+ * @param rb_text [String] e.g. "cap_net_raw,cap_net_bind_service+eip cap_kill=p"
+ * @raise [ArgumentError] The text is malformed or names an unknown capability.
+ * @return [Hash] :effective, :permitted and :inheritable masks, which can be
+ *   passed to CapNG::Policy.compile as +{mask: Integer}+.
+ *
+ * @example
+ *  masks = CapNG::Capability.parse_text("cap_chown,cap_kill+ep")
+ *  #=> {effective: 33, permitted: 33, inheritable: 0}
+ *  CapNG::Policy.compile(**masks.transform_values { |mask| {mask: mask} })
+ */
+static VALUE
+rb_capng_capability_s_parse_text(VALUE self, VALUE rb_text)
+{
+  CapabilitySets sets;
+  size_t error_offset = 0;
+  const char* error = NULL;
+  VALUE rb_result;
+
+  StringValue(rb_text);
+  if (parse_capability_text(
+        RSTRING_PTR(rb_text), (size_t)RSTRING_LEN(rb_text), &sets, &error_offset, &error) !=
+      0) {
+    rb_raise(rb_eArgError,
+             "Invalid capability text at offset %lu: %s",
+             (unsigned long)error_offset,
+             error);
+  }
+
+  rb_result = rb_hash_new();
+  rb_hash_aset(rb_result, ID2SYM(rb_intern("effective")), ULL2NUM(sets.effective));
+  rb_hash_aset(rb_result, ID2SYM(rb_intern("permitted")), ULL2NUM(sets.permitted));
+  rb_hash_aset(rb_result, ID2SYM(rb_intern("inheritable")), ULL2NUM(sets.inheritable));
+
+  return rb_result;
+}
+
 void
 Init_capng_capability(VALUE rb_cCapNG)
 {
@@ -150,6 +198,12 @@ Init_capng_capability(VALUE rb_cCapNG)
   rb_define_method(rb_cCapability, "from_name", rb_capng_capability_from_name, 1);
   rb_define_method(rb_cCapability, "each", rb_capng_capability_each, 0);
 
+  rb_define_singleton_method(rb_cCapability, "mask", rb_capng_capability_s_mask, -1);
+  rb_define_singleton_method(
+    rb_cCapability, "parse_text", rb_capng_capability_s_parse_text, 1);
+  rb_define_singleton_method(rb_cCapability, "to_name", rb_capng_capability_to_name, 1);
+  rb_define_singleton_method(rb_cCapability, "from_name", rb_capng_capability_from_name, 1);
+
   // Capability constants.
 
   /* Make arbitrary changes to file UIDs and GIDs (see chown(2)). */
@@ -13,7 +13,7 @@
 
 #include <capng.h>
 
-CapabilityInfo capabilityInfoTable[] = {
+const CapabilityInfo capabilityInfoTable[] = {
   {CAP_CHOWN,              "chown"},
   {CAP_DAC_OVERRIDE,       "dac_override"},
   {CAP_DAC_READ_SEARCH,    "dac_read_search"},
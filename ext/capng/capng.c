@@ -36,38 +36,24 @@
  */
 /* clang-format on */
 
-struct CapNG
-{};
-
-static void
-capng_free(void* capng);
-
 static const rb_data_type_t rb_capng_type = { "capng/capng",
                                               {
                                                 0,
-                                                capng_free,
+                                                0,
                                                 0,
                                               },
                                               NULL,
                                               NULL,
                                               RUBY_TYPED_FREE_IMMEDIATELY };
 
-static void
-capng_free(void* ptr)
-{
-  xfree(ptr);
-}
-
 static VALUE
 rb_capng_alloc(VALUE klass)
 {
-  VALUE obj;
-  struct CapNG* capng;
-  obj = TypedData_Make_Struct(klass, struct CapNG, &rb_capng_type, capng);
-  return obj;
+  /* No per-object state, so don't allocate any. */
+  return TypedData_Wrap_Struct(klass, &rb_capng_type, NULL);
 }
 
-static int
+int
 capng_get_file_descriptor(VALUE rb_file)
 {
 #ifdef HAVE_RB_IO_DESCRIPTOR
@@ -112,16 +98,22 @@ rb_capng_initialize(int argc, VALUE* argv, VALUE self)
   }
 
   if (strcmp(target, "current_process") == 0) {
-    result = capng_get_caps_process();
-    if (result != 0) {
-      rb_raise(rb_eRuntimeError, "Couldn't get current process' capability");
-    }
+    const CapabilitySets* sets = current_capability_sets(1);
+
+    ractor_state_enter();
+    capng_setpid(kernel_gettid());
+    ractor_state_setpid(0);
+    load_capability_sets(sets);
+    ractor_state_leave();
   } else if (strcmp(target, "other_process") == 0) {
     Check_Type(rb_pid, T_FIXNUM);
 
     pid = NUM2INT(rb_pid);
+    ractor_state_enter();
     capng_setpid(pid);
+    ractor_state_setpid(pid);
     result = capng_get_caps_process();
+    ractor_state_leave();
     if (result != 0) {
       rb_raise(rb_eRuntimeError, "Couldn't get current process' capability");
     }
@@ -160,7 +152,11 @@ rb_capng_clear(VALUE self, VALUE rb_select_name_or_enum)
                "Expected a String or a Symbol instance, or a capability type constant");
   }
 
+  ractor_state_enter();
   capng_clear(select);
+  ractor_state_leave();
+  TRACE_RECORD(TRACE_CLEAR, select, 0, 0, 0, 0, 0, 0);
+  invalidate_current_capability_sets();
 
   return Qnil;
 }
@@ -195,7 +191,11 @@ rb_capng_fill(VALUE self, VALUE rb_select_name_or_enum)
                "Expected a String or a Symbol instance, or a capability type constant");
   }
 
+  ractor_state_enter();
   capng_fill(select);
+  ractor_state_leave();
+  TRACE_RECORD(TRACE_FILL, select, 0, 0, 0, 0, 0, 0);
+  invalidate_current_capability_sets();
 
   return Qnil;
 }
@@ -213,7 +213,10 @@ rb_capng_setpid(VALUE self, VALUE rb_pid)
 {
   Check_Type(rb_pid, T_FIXNUM);
 
+  ractor_state_enter();
   capng_setpid(NUM2INT(rb_pid));
+  ractor_state_setpid(NUM2INT(rb_pid));
+  ractor_state_leave();
 
   return Qnil;
 }
@@ -229,7 +232,10 @@ static VALUE
 rb_capng_get_caps_process(VALUE self)
 {
   int result = 0;
+
+  ractor_state_enter();
   result = capng_get_caps_process();
+  ractor_state_leave();
 
   if (result == 0)
     return Qtrue;
@@ -315,7 +321,18 @@ rb_capng_update(VALUE self, VALUE rb_action_name_or_action,
                "Expected a String or a Symbol instance, or a capability constant");
   }
 
+  ractor_state_enter();
   result = capng_update(action, capability_type, capability);
+  ractor_state_leave();
+  TRACE_RECORD(TRACE_UPDATE,
+               action,
+               capability_type,
+               0,
+               (capability >= 0 && capability <= CAPNG_C_LAST_CAP) ? CAPNG_C_MASK(capability)
+                                                                    : 0,
+               0,
+               result,
+               result ? errno : 0);
 
   if (result == 0)
     return Qtrue;
@@ -326,9 +343,14 @@ rb_capng_update(VALUE self, VALUE rb_action_name_or_action,
 /*
  * Apply capabilities on specified target.
  *
+ * Sets which are unchanged since they were last applied on the calling
+ * thread are skipped without issuing capset(2) or prctl(2).
+ *
  * @param rb_select_name_or_enum [Symbol or String or Fixnum]
  *   targets are CAPS, BOUNDS, BOTH, and AMBIENT for supported platform.
  *
+ * @see: CapNG.apply_stats
+ *
  * @return [Boolean]
  *
  */
@@ -354,7 +376,9 @@ rb_capng_apply(VALUE self, VALUE rb_select_name_or_enum)
                "Expected a String or a Symbol instance, or a capability type constant");
   }
 
-  result = capng_apply(select);
+  ractor_state_enter();
+  result = apply_capabilities(select);
+  ractor_state_leave();
 
   if (result == 0)
     return Qtrue;
@@ -373,7 +397,11 @@ rb_capng_lock(VALUE self)
 {
   int result = 0;
 
+  ractor_state_enter();
   result = capng_lock();
+  ractor_state_leave();
+  TRACE_RECORD(TRACE_LOCK, 0, 0, 0, 0, 0, result, result ? errno : 0);
+  invalidate_current_capability_sets();
 
   if (result == 0)
     return Qtrue;
@@ -394,7 +422,19 @@ rb_capng_change_id(VALUE self, VALUE rb_uid, VALUE rb_gid, VALUE rb_flags)
 {
   int result = 0;
 
+  ractor_state_enter();
   result = capng_change_id(NUM2INT(rb_uid), NUM2INT(rb_gid), NUM2INT(rb_flags));
+  ractor_state_leave();
+  TRACE_RECORD(TRACE_CHANGE_ID,
+               NUM2INT(rb_uid),
+               NUM2INT(rb_gid),
+               NUM2INT(rb_flags),
+               0,
+               0,
+               result,
+               result ? errno : 0);
+  invalidate_applied_capabilities();
+  invalidate_current_capability_sets();
 
   if (result == 0)
     return Qtrue;
@@ -434,18 +474,35 @@ rb_capng_have_capabilities_p(VALUE self, VALUE rb_select_name_or_enum)
       rb_raise(rb_eArgError,
                "Expected a String or a Symbol instance, or a capability type constant");
   }
+  ractor_state_enter();
   result = capng_have_capabilities(select);
+  ractor_state_leave();
 
   return INT2NUM(result);
 }
 
+static uint64_t
+capng_held_capabilities(capng_type_t capability_type, uint64_t requested)
+{
+  uint64_t held = 0;
+
+  for (unsigned int capability = 0; capability <= CAPNG_C_LAST_CAP; capability++) {
+    if (!(requested & CAPNG_C_MASK(capability)))
+      continue;
+    if (capng_have_capability(capability_type, capability) == 1)
+      held |= CAPNG_C_MASK(capability);
+  }
+
+  return held;
+}
+
 /*
  * Check whether capabilities on specified target or not.
  *
  * @param rb_capability_name_or_type [Symbol or String or Fixnum] types are EFFECTIVE,
  *   INHERITABLE, PERMITTED, and AMBIENT for supported platform.
- * @param rb_capability_or_name [Symbol or String or Fixnum]
- *   Capability name or constants.
+ * @param rb_capability_or_name [Symbol or String or Fixnum or Array]
+ *   Capability name or constants. An Array is true only when all of them are held.
  *
  * @see: [CapNG::Capability]
  *
@@ -458,6 +515,7 @@ rb_capng_have_capability_p(VALUE self, VALUE rb_capability_name_or_type,
 {
   int result = 0;
   unsigned int capability = 0;
+  uint64_t requested = 0, held = 0;
   capng_type_t capability_type = 0;
 
   switch (TYPE(rb_capability_name_or_type)) {
@@ -478,6 +536,12 @@ rb_capng_have_capability_p(VALUE self, VALUE rb_capability_name_or_type,
   }
 
   switch (TYPE(rb_capability_or_name)) {
+    case T_ARRAY:
+      requested = value_to_capability_mask(rb_capability_or_name);
+      ractor_state_enter();
+      held = capng_held_capabilities(capability_type, requested);
+      ractor_state_leave();
+      return held == requested ? Qtrue : Qfalse;
     case T_SYMBOL:
       capability =
         capng_name_to_capability(RSTRING_PTR(rb_sym2str(rb_capability_or_name)));
@@ -493,7 +557,9 @@ rb_capng_have_capability_p(VALUE self, VALUE rb_capability_name_or_type,
                "Expected a String or a Symbol instance, or a capability constant");
   }
 
+  ractor_state_enter();
   result = capng_have_capability(capability_type, capability);
+  ractor_state_leave();
 
   if (result == 1)
     return Qtrue;
@@ -501,6 +567,130 @@ rb_capng_have_capability_p(VALUE self, VALUE rb_capability_name_or_type,
     return Qfalse;
 }
 
+/*
+ * Check whether all of the given capabilities are held.
+ *
+ * @param rb_capability_name_or_type [Symbol or String or Fixnum] types are EFFECTIVE,
+ *   INHERITABLE, PERMITTED, BOUNDING_SET, and AMBIENT for supported platform.
+ * @param rb_capabilities_or_mask [Array, Symbol, String, Integer, Hash] Capability
+ *   names or constants, or {mask: Integer} for a mask built by
+ *   CapNG::Capability.mask.
+ *
+ * @return [Boolean]
+ *
+ */
+static VALUE
+rb_capng_have_all_capabilities_p(VALUE self, VALUE rb_capability_name_or_type,
+                                 VALUE rb_capabilities_or_mask)
+{
+  capng_type_t capability_type = value_to_capability_type(rb_capability_name_or_type);
+  uint64_t requested = value_to_requested_mask(rb_capabilities_or_mask);
+  uint64_t held = 0;
+
+  ractor_state_enter();
+  held = capng_held_capabilities(capability_type, requested);
+  ractor_state_leave();
+
+  return held == requested ? Qtrue : Qfalse;
+}
+
+/*
+ * Check whether any of the given capabilities is held.
+ *
+ * @param rb_capability_name_or_type [Symbol or String or Fixnum] types are EFFECTIVE,
+ *   INHERITABLE, PERMITTED, BOUNDING_SET, and AMBIENT for supported platform.
+ * @param rb_capabilities_or_mask [Array, Symbol, String, Integer, Hash] Capability
+ *   names or constants, or {mask: Integer} for a mask built by
+ *   CapNG::Capability.mask.
+ *
+ * @return [Boolean]
+ *
+ */
+static VALUE
+rb_capng_have_any_capability_p(VALUE self, VALUE rb_capability_name_or_type,
+                               VALUE rb_capabilities_or_mask)
+{
+  capng_type_t capability_type = value_to_capability_type(rb_capability_name_or_type);
+  uint64_t requested = value_to_requested_mask(rb_capabilities_or_mask);
+  uint64_t held = 0;
+
+  ractor_state_enter();
+  held = capng_held_capabilities(capability_type, requested);
+  ractor_state_leave();
+
+  return held ? Qtrue : Qfalse;
+}
+
+/*
+ * Obtain the given capabilities which are not held.
+ *
+ * @param rb_capability_name_or_type [Symbol or String or Fixnum] types are EFFECTIVE,
+ *   INHERITABLE, PERMITTED, BOUNDING_SET, and AMBIENT for supported platform.
+ * @param rb_capabilities_or_mask [Array, Symbol, String, Integer, Hash] Capability
+ *   names or constants, or {mask: Integer} for a mask built by
+ *   CapNG::Capability.mask.
+ *
+ * @return [Array or Integer] The missing elements of the given Array as they
+ *   were passed, otherwise the mask of the missing capabilities.
+ *
+ */
+static VALUE
+rb_capng_missing_capabilities(VALUE self, VALUE rb_capability_name_or_type,
+                              VALUE rb_capabilities_or_mask)
+{
+  capng_type_t capability_type = value_to_capability_type(rb_capability_name_or_type);
+  uint64_t requested = value_to_requested_mask(rb_capabilities_or_mask);
+  uint64_t held = 0;
+  VALUE missing;
+
+  ractor_state_enter();
+  held = capng_held_capabilities(capability_type, requested);
+  ractor_state_leave();
+
+  if (!RB_TYPE_P(rb_capabilities_or_mask, T_ARRAY))
+    return ULL2NUM(requested & ~held);
+
+  missing = rb_ary_new();
+  if (held == requested)
+    return missing;
+
+  for (long i = 0; i < RARRAY_LEN(rb_capabilities_or_mask); i++) {
+    VALUE rb_capability = RARRAY_AREF(rb_capabilities_or_mask, i);
+    if (!(held & CAPNG_C_MASK(value_to_capability(rb_capability))))
+      rb_ary_push(missing, rb_capability);
+  }
+
+  return missing;
+}
+
+/*
+ * Obtain the capabilities of the specified type as a bit mask, where
+ * bit N is set when the capability constant N is held.
+ *
+ * @param rb_capability_name_or_type [Symbol or String or Fixnum] types are EFFECTIVE,
+ *   INHERITABLE, PERMITTED, BOUNDING_SET, and AMBIENT for supported platform.
+ *
+ * @example
+ *  mask = @capng.capabilities_mask(:effective)
+ *  required = CapNG::Capability.mask(:net_raw, :net_admin)
+ *  mask & required == required
+ *
+ * @return [Integer]
+ *
+ */
+static VALUE
+rb_capng_capabilities_mask(VALUE self, VALUE rb_capability_name_or_type)
+{
+  capng_type_t capability_type = value_to_capability_type(rb_capability_name_or_type);
+  uint64_t mask = 0;
+
+  ractor_state_enter();
+  mask = capability_mask(capability_type);
+  ractor_state_leave();
+
+  return ULL2NUM(mask);
+}
+
 /*
  * Retrieve capabilities from file.
  *
@@ -520,7 +710,9 @@ rb_capng_get_caps_file(VALUE self, VALUE rb_file)
     return Qfalse;
   }
   fd = capng_get_file_descriptor(rb_file);
+  ractor_state_enter();
   result = capng_get_caps_fd(fd);
+  ractor_state_leave();
 
   if (result == 0)
     return Qtrue;
@@ -548,7 +740,9 @@ rb_capng_apply_caps_file(VALUE self, VALUE rb_file)
   }
 
   fd = capng_get_file_descriptor(rb_file);
+  ractor_state_enter();
   result = capng_apply_caps_fd(fd);
+  ractor_state_leave();
 
   if (result == 0)
     return Qtrue;
@@ -556,11 +750,158 @@ rb_capng_apply_caps_file(VALUE self, VALUE rb_file)
     return Qfalse;
 }
 
+/* Capability types which can be raised temporarily, in capng_type_t bit order. */
+static const capng_type_t elevation_types[] = {
+  CAPNG_EFFECTIVE,
+  CAPNG_PERMITTED,
+  CAPNG_INHERITABLE,
+#if defined(HAVE_CONST_CAPNG_AMBIENT)
+  CAPNG_AMBIENT,
+#endif
+};
+
+#define ELEVATION_TYPES_LEN (sizeof(elevation_types) / sizeof(elevation_types[0]))
+
+struct CapNGElevation
+{
+  uint64_t added[ELEVATION_TYPES_LEN];
+  capng_select_t select;
+};
+
+static capng_select_t
+capng_elevation_select(struct CapNGElevation* elevation)
+{
+  capng_select_t select = 0;
+
+  for (size_t i = 0; i < ELEVATION_TYPES_LEN; i++) {
+    if (!elevation->added[i])
+      continue;
+#if defined(HAVE_CONST_CAPNG_AMBIENT) && defined(HAVE_CONST_CAPNG_SELECT_AMBIENT)
+    if (elevation_types[i] == CAPNG_AMBIENT) {
+      select |= CAPNG_SELECT_AMBIENT;
+      continue;
+    }
+#endif
+    select |= CAPNG_SELECT_CAPS;
+  }
+
+  return select;
+}
+
+static void
+capng_elevation_drop(struct CapNGElevation* elevation)
+{
+  for (size_t i = 0; i < ELEVATION_TYPES_LEN; i++) {
+    for (unsigned int capability = 0; capability <= CAPNG_C_LAST_CAP; capability++) {
+      if (elevation->added[i] & CAPNG_C_MASK(capability))
+        capng_update(CAPNG_DROP, elevation_types[i], capability);
+    }
+  }
+}
+
+static VALUE
+capng_elevation_yield(VALUE arg)
+{
+  return rb_yield(Qnil);
+}
+
+static VALUE
+capng_elevation_restore(VALUE arg)
+{
+  struct CapNGElevation* elevation = (struct CapNGElevation*)arg;
+  int result = 0;
+
+  ractor_state_enter();
+  capng_elevation_drop(elevation);
+  if (elevation->select)
+    result = apply_capabilities(elevation->select);
+  ractor_state_leave();
+
+  if (result != 0) {
+    rb_raise(rb_eRuntimeError, "Couldn't restore capabilities after elevation");
+  }
+
+  return Qnil;
+}
+
+/*
+ * Raise capabilities only while the given block runs.
+ *
+ * Only the capabilities missing from the current libcap-ng state are
+ * added and applied on entry, and exactly those are dropped and applied
+ * again when the block exits, even if it raises. The saved delta lives
+ * on the calling thread's stack, so no heap allocation is involved.
+ *
+ * @param rb_capability_name_or_type [Symbol or String or Fixnum] types are EFFECTIVE,
+ *   PERMITTED, INHERITABLE, AMBIENT for supported platform, or their combinations.
+ * @param rb_capabilities [Array or Symbol or String or Fixnum]
+ *   Capability names or constants.
+ *
+ * @example
+ *  CapNG.new(:current_process)
+ *  CapNG.with_capabilities(:effective, [:dac_read_search]) do
+ *    File.read("/var/log/secure")
+ *  end
+ *
+ * @return [Object] The value of the block.
+ *
+ */
+static VALUE
+rb_capng_s_with_capabilities(VALUE self, VALUE rb_capability_name_or_type,
+                             VALUE rb_capabilities)
+{
+  struct CapNGElevation elevation = { { 0 }, 0 };
+  capng_type_t capability_type = 0;
+  uint64_t requested = 0;
+
+  rb_need_block();
+
+  capability_type = value_to_capability_type(rb_capability_name_or_type);
+  if (capability_type & CAPNG_BOUNDING_SET) {
+    rb_raise(rb_eArgError, "The bounding set cannot be raised");
+  }
+
+  requested = value_to_capability_mask(rb_capabilities);
+
+  ractor_state_enter();
+  for (size_t i = 0; i < ELEVATION_TYPES_LEN; i++) {
+    if (!(capability_type & elevation_types[i]))
+      continue;
+    for (unsigned int capability = 0; capability <= CAPNG_C_LAST_CAP; capability++) {
+      if (!(requested & CAPNG_C_MASK(capability)))
+        continue;
+      if (capng_have_capability(elevation_types[i], capability) == 1)
+        continue;
+      if (capng_update(CAPNG_ADD, elevation_types[i], capability) != 0) {
+        capng_elevation_drop(&elevation);
+        ractor_state_leave();
+        rb_raise(rb_eRuntimeError, "Couldn't add capability: %u", capability);
+      }
+      elevation.added[i] |= CAPNG_C_MASK(capability);
+    }
+  }
+
+  elevation.select = capng_elevation_select(&elevation);
+  if (elevation.select && apply_capabilities(elevation.select) != 0) {
+    capng_elevation_drop(&elevation);
+    ractor_state_leave();
+    rb_raise(rb_eRuntimeError, "Couldn't apply elevated capabilities");
+  }
+  ractor_state_leave();
+
+  return rb_ensure(
+    capng_elevation_yield, Qnil, capng_elevation_restore, (VALUE)&elevation);
+}
+
 void
 Init_capng(void)
 {
   VALUE rb_cCapNG = rb_define_class("CapNG", rb_cObject);
 
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  rb_ext_ractor_safe(true);
+#endif
+
   rb_define_alloc_func(rb_cCapNG, rb_capng_alloc);
 
   rb_define_method(rb_cCapNG, "initialize", rb_capng_initialize, -1);
@@ -575,12 +916,64 @@ Init_capng(void)
   rb_define_method(rb_cCapNG, "change_id", rb_capng_change_id, 3);
   rb_define_method(rb_cCapNG, "have_capabilities?", rb_capng_have_capabilities_p, 1);
   rb_define_method(rb_cCapNG, "have_capability?", rb_capng_have_capability_p, 2);
+  rb_define_method(
+    rb_cCapNG, "have_all_capabilities?", rb_capng_have_all_capabilities_p, 2);
+  rb_define_method(
+    rb_cCapNG, "have_any_capability?", rb_capng_have_any_capability_p, 2);
+  rb_define_method(rb_cCapNG, "missing_capabilities", rb_capng_missing_capabilities, 2);
+  rb_define_method(rb_cCapNG, "capabilities_mask", rb_capng_capabilities_mask, 1);
   rb_define_method(rb_cCapNG, "get_caps_file", rb_capng_get_caps_file, 1);
   rb_define_method(rb_cCapNG, "caps_file", rb_capng_get_caps_file, 1);
   rb_define_method(rb_cCapNG, "apply_caps_file", rb_capng_apply_caps_file, 1);
 
+  rb_define_singleton_method(
+    rb_cCapNG, "with_capabilities", rb_capng_s_with_capabilities, 2);
+
+  /* None of the methods above depend on the receiver because libcap-ng
+   * keeps its state per thread, so they are also callable on the class
+   * without allocating an instance. */
+  rb_define_singleton_method(rb_cCapNG, "clear", rb_capng_clear, 1);
+  rb_define_singleton_method(rb_cCapNG, "fill", rb_capng_fill, 1);
+  rb_define_singleton_method(rb_cCapNG, "setpid", rb_capng_setpid, 1);
+  rb_define_singleton_method(rb_cCapNG, "caps_process", rb_capng_get_caps_process, 0);
+  rb_define_singleton_method(rb_cCapNG, "get_caps_process", rb_capng_get_caps_process, 0);
+  rb_define_singleton_method(rb_cCapNG, "update", rb_capng_update, 3);
+  rb_define_singleton_method(rb_cCapNG, "apply", rb_capng_apply, 1);
+  rb_define_singleton_method(rb_cCapNG, "lock", rb_capng_lock, 0);
+  rb_define_singleton_method(rb_cCapNG, "change_id", rb_capng_change_id, 3);
+  rb_define_singleton_method(
+    rb_cCapNG, "have_capabilities?", rb_capng_have_capabilities_p, 1);
+  rb_define_singleton_method(rb_cCapNG, "have_capability?", rb_capng_have_capability_p, 2);
+  rb_define_singleton_method(
+    rb_cCapNG, "have_all_capabilities?", rb_capng_have_all_capabilities_p, 2);
+  rb_define_singleton_method(
+    rb_cCapNG, "have_any_capability?", rb_capng_have_any_capability_p, 2);
+  rb_define_singleton_method(
+    rb_cCapNG, "missing_capabilities", rb_capng_missing_capabilities, 2);
+  rb_define_singleton_method(
+    rb_cCapNG, "capabilities_mask", rb_capng_capabilities_mask, 1);
+  rb_define_singleton_method(rb_cCapNG, "get_caps_file", rb_capng_get_caps_file, 1);
+  rb_define_singleton_method(rb_cCapNG, "caps_file", rb_capng_get_caps_file, 1);
+  rb_define_singleton_method(rb_cCapNG, "apply_caps_file", rb_capng_apply_caps_file, 1);
+
+  Init_capng_ractor(rb_cCapNG);
+  Init_capng_snapshot(rb_cCapNG);
   Init_capng_enum(rb_cCapNG);
+  Init_capng_apply(rb_cCapNG);
+  Init_capng_audit(rb_cCapNG);
+  Init_capng_broadcast(rb_cCapNG);
+  Init_capng_ambient(rb_cCapNG);
+  Init_capng_current(rb_cCapNG);
+  Init_capng_scan(rb_cCapNG);
+  Init_capng_each(rb_cCapNG);
   Init_capng_capability(rb_cCapNG);
+  Init_capng_file_capability(rb_cCapNG);
+  Init_capng_policy(rb_cCapNG);
   Init_capng_print(rb_cCapNG);
+  Init_capng_privilege_drop(rb_cCapNG);
   Init_capng_state(rb_cCapNG);
+  Init_capng_status(rb_cCapNG);
+  Init_capng_threads(rb_cCapNG);
+  Init_capng_trace(rb_cCapNG);
+  Init_capng_transition(rb_cCapNG);
 }
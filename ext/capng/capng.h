@@ -20,6 +20,7 @@
 
 #include <cap-ng.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -44,20 +45,220 @@ print_name_to_print_type(char* print_name);
 capng_type_t
 capability_type_name_to_capability_type(char* capability_name);
 
+/* Small TypedData structs live in the object slot itself where supported. Ruby
+ * only embeds a struct that fits the slot; for an embeddable type it releases a
+ * struct that did not fit itself after calling dfree, so dfree must not. */
+#if defined(HAVE_CONST_RUBY_TYPED_EMBEDDABLE)
+#define CAPNG_TYPED_EMBEDDABLE RUBY_TYPED_EMBEDDABLE
+#define CAPNG_TYPED_EMBEDDED_P(obj) RTYPEDDATA_EMBEDDED_P(obj)
+#else
+#define CAPNG_TYPED_EMBEDDABLE 0
+#define CAPNG_TYPED_EMBEDDED_P(obj) 0
+#endif
+
+/* Capability masks are 64 bits wide, so capability numbers must not exceed 63. */
+#define CAPNG_C_LAST_CAP 63
+#define CAPNG_C_MASK(capability) (((uint64_t)1) << (capability))
+/* The capability types handled by capget(2)/capset(2). */
+#define CAPNG_C_CAPS_TYPES (CAPNG_EFFECTIVE | CAPNG_PERMITTED | CAPNG_INHERITABLE)
+
+capng_select_t
+value_to_select_type(VALUE rb_select_name_or_enum);
+capng_type_t
+value_to_capability_type(VALUE rb_capability_name_or_type);
+unsigned int
+value_to_capability(VALUE rb_capability_or_name);
+uint64_t
+value_to_capability_mask(VALUE rb_capabilities);
+uint64_t
+value_to_requested_mask(VALUE rb_capabilities_or_mask);
+uint64_t
+capability_mask(capng_type_t capability_type);
+
 typedef struct {
   int code;
   const char* name;
 } CapabilityInfo;
 
-extern CapabilityInfo capabilityInfoTable[];
+extern const CapabilityInfo capabilityInfoTable[];
+
+typedef struct {
+  uint64_t effective;
+  uint64_t permitted;
+  uint64_t inheritable;
+} KernelCapabilities;
+
+int
+kernel_capget(int tid, KernelCapabilities* caps);
+int
+kernel_capset(const KernelCapabilities* caps);
+int
+kernel_set_ambient(uint64_t ambient);
+int
+kernel_drop_bounding(uint64_t keep);
+int
+kernel_lock_securebits(void);
+int
+kernel_set_keepcaps(int keep);
+int
+kernel_gettid(void);
+int
+kernel_pidfd_open(int pid);
+int
+kernel_pidfd_alive(int pidfd);
+
+typedef struct {
+  uint64_t effective;
+  uint64_t permitted;
+  uint64_t inheritable;
+  uint64_t bounding;
+  uint64_t ambient;
+} CapabilitySets;
+
+#define PROC_STATUS_BUFFER_SIZE 4096
+#define PROC_STATUS_EFFECTIVE 0x01
+#define PROC_STATUS_PERMITTED 0x02
+#define PROC_STATUS_INHERITABLE 0x04
+#define PROC_STATUS_BOUNDING 0x08
+#define PROC_STATUS_AMBIENT 0x10
+
+typedef struct {
+  int found;
+  int pid;
+  int tgid;
+  int ppid;
+  long uid;
+  long gid;
+  char name[64];
+  CapabilitySets sets;
+} ProcStatus;
+
+/* Record layout returned by getdents64(2). */
+struct CapNGDirent64
+{
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+int
+read_proc_status_fd(int fd, ProcStatus* status, char* buffer, size_t size);
+int
+read_proc_status(const char* path, ProcStatus* status, char* buffer, size_t size);
+int
+read_thread_bounding_ambient(uint64_t* bounding, uint64_t* ambient);
+
+#define FILE_CAPS_REVISION_1 1
+#define FILE_CAPS_REVISION_2 2
+#define FILE_CAPS_REVISION_3 3
+
+typedef struct {
+  int version;
+  int effective;
+  uint64_t permitted;
+  uint64_t inheritable;
+  uint32_t rootid;
+} FileCapabilities;
+
+int
+decode_file_capabilities(const void* data, size_t size, FileCapabilities* caps);
+int
+read_file_capabilities(const char* path, int follow_symlinks, FileCapabilities* caps);
+const char*
+capability_name(unsigned int capability);
+int
+parse_capability_text(const char* text,
+                      size_t len,
+                      CapabilitySets* sets,
+                      size_t* error_offset,
+                      const char** error);
+int
+capng_get_file_descriptor(VALUE rb_file);
+VALUE
+capng_status_from_errno(int error);
+int
+capng_lookup_user(VALUE rb_user, uid_t* uid, gid_t* gid, char* name, size_t size);
+
+uint64_t
+capability_sets_mask(const CapabilitySets* sets, capng_type_t capability_type);
+void
+load_capability_sets(const CapabilitySets* sets);
+const CapabilitySets*
+current_capability_sets(int with_bounding_ambient);
+void
+invalidate_current_capability_sets(void);
+
+void
+ractor_state_enter(void);
+void
+ractor_state_leave(void);
+void
+ractor_state_setpid(int pid);
+
+typedef enum {
+  TRACE_UPDATE = 1,
+  TRACE_CLEAR,
+  TRACE_FILL,
+  TRACE_APPLY,
+  TRACE_LOCK,
+  TRACE_CHANGE_ID,
+  TRACE_STATE_RESTORE,
+  TRACE_TRANSITION,
+  TRACE_APPLY_ALL_THREADS,
+  TRACE_PRIVILEGE_DROP,
+  TRACE_AMBIENT_HANDOFF,
+} TraceOperation;
+
+extern int trace_enabled;
+void
+trace_record(TraceOperation operation,
+             int arg0,
+             int arg1,
+             int arg2,
+             uint64_t mask0,
+             uint64_t mask1,
+             int result,
+             int error);
+
+/* Arguments are only evaluated while tracing is enabled. */
+#define TRACE_RECORD(...)                                  \
+  do {                                                     \
+    if (__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED)) \
+      trace_record(__VA_ARGS__);                           \
+  } while (0)
+
+int
+apply_capabilities(capng_select_t select);
+void
+invalidate_applied_capabilities(void);
+void
+invalidate_applied_capabilities_all_threads(void);
 
+void Init_capng_ambient(VALUE);
+void Init_capng_apply(VALUE);
+void Init_capng_audit(VALUE);
+void Init_capng_broadcast(VALUE);
 void Init_capng_capability(VALUE);
+void Init_capng_current(VALUE);
+void Init_capng_each(VALUE);
 void Init_capng_enum(VALUE);
 void Init_capng_enum_action(VALUE);
 void Init_capng_enum_flags(VALUE);
 void Init_capng_enum_result(VALUE);
 void Init_capng_enum_select(VALUE);
 void Init_capng_enum_type(VALUE);
+void Init_capng_file_capability(VALUE);
+void Init_capng_policy(VALUE);
 void Init_capng_print(VALUE);
+void Init_capng_privilege_drop(VALUE);
+void Init_capng_ractor(VALUE);
+void Init_capng_scan(VALUE);
+void Init_capng_snapshot(VALUE);
 void Init_capng_state(VALUE);
+void Init_capng_status(VALUE);
+void Init_capng_threads(VALUE);
+void Init_capng_trace(VALUE);
+void Init_capng_transition(VALUE);
 #endif // _CAPNG_H
@@ -0,0 +1,77 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+/* Queries against the kernel's view of the calling thread. They are
+ * answered from the memoized snapshot in snapshot.c, which is read with
+ * a single capget(2) for the effective, permitted and inheritable sets
+ * and a single read of /proc/thread-self/status for the bounding and
+ * ambient sets. libcap-ng's working state is never touched. */
+
+#include <capng.h>
+
+/*
+ * Check whether the calling thread holds the capability right now.
+ *
+ * Unlike CapNG#have_capability?, this asks the kernel instead of the
+ * libcap-ng working state, and doesn't modify that state. The answer is
+ * memoized until CapNG changes capabilities or CapNG.refresh! is called.
+ *
+ * @param rb_capability_name_or_type [Symbol or String or Fixnum] types are EFFECTIVE,
+ *   INHERITABLE, PERMITTED, BOUNDING_SET, and AMBIENT for supported platform.
+ * @param rb_capability_or_name [Symbol or String or Fixnum or Array]
+ *   Capability name or constants. An Array is true only when all of them are held.
+ *
+ * @return [Boolean]
+ *
+ */
+static VALUE
+rb_capng_s_current_capability_p(VALUE self, VALUE rb_capability_name_or_type,
+                                VALUE rb_capability_or_name)
+{
+  capng_type_t capability_type = value_to_capability_type(rb_capability_name_or_type);
+  uint64_t requested = value_to_capability_mask(rb_capability_or_name);
+  uint64_t held = capability_sets_mask(
+    current_capability_sets(capability_type & ~CAPNG_C_CAPS_TYPES),
+    capability_type);
+
+  return (held & requested) == requested ? Qtrue : Qfalse;
+}
+
+/*
+ * Obtain the calling thread's capabilities of the specified type as a
+ * bit mask.
+ *
+ * @param rb_capability_name_or_type [Symbol or String or Fixnum] types are EFFECTIVE,
+ *   INHERITABLE, PERMITTED, BOUNDING_SET, and AMBIENT for supported platform.
+ *
+ * @return [Integer]
+ *
+ */
+static VALUE
+rb_capng_s_current_capabilities_mask(VALUE self, VALUE rb_capability_name_or_type)
+{
+  capng_type_t capability_type = value_to_capability_type(rb_capability_name_or_type);
+
+  return ULL2NUM(capability_sets_mask(
+    current_capability_sets(capability_type & ~CAPNG_C_CAPS_TYPES),
+    capability_type));
+}
+
+void
+Init_capng_current(VALUE rb_cCapNG)
+{
+  rb_define_singleton_method(
+    rb_cCapNG, "current_capability?", rb_capng_s_current_capability_p, 2);
+  rb_define_singleton_method(
+    rb_cCapNG, "current_capabilities_mask", rb_capng_s_current_capabilities_mask, 1);
+}
@@ -0,0 +1,202 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+
+/* Incremental process enumeration.
+ *
+ * /proc is read with getdents64(2) one batch at a time and each pid is
+ * parsed and filtered natively before anything is handed to Ruby, so
+ * neither the directory listing nor the results are ever held in full.
+ * When the block breaks out, the directory is closed and no further I/O
+ * happens. An external enumerator which is dropped before the end never
+ * resumes its iteration, so the state is also released on GC. */
+
+#include <capng.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define EACH_DIRENT_BATCH_SIZE 8192
+
+struct CapNGEachProcess
+{
+  int fd;
+  uint64_t filter;
+  capng_type_t type;
+  char* dirents;
+  char status_buffer[PROC_STATUS_BUFFER_SIZE];
+};
+
+static void
+capng_each_process_close(struct CapNGEachProcess* each)
+{
+  if (each->fd >= 0) {
+    close(each->fd);
+    each->fd = -1;
+  }
+  xfree(each->dirents);
+  each->dirents = NULL;
+}
+
+static void
+capng_each_process_free(void* ptr)
+{
+  capng_each_process_close((struct CapNGEachProcess*)ptr);
+  xfree(ptr);
+}
+
+static size_t
+capng_each_process_memsize(const void* ptr)
+{
+  const struct CapNGEachProcess* each = (const struct CapNGEachProcess*)ptr;
+
+  return sizeof(*each) + (each->dirents ? EACH_DIRENT_BATCH_SIZE : 0);
+}
+
+static const rb_data_type_t rb_capng_each_process_type = {
+  "capng/each_process",
+  {
+    0,
+    capng_each_process_free,
+    capng_each_process_memsize,
+  },
+  NULL,
+  NULL,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+capng_each_process_yield(int pid, const ProcStatus* status)
+{
+  VALUE rb_process = rb_hash_new();
+
+  rb_hash_aset(rb_process, ID2SYM(rb_intern("pid")), INT2NUM(pid));
+  rb_hash_aset(rb_process, ID2SYM(rb_intern("name")), rb_str_new_cstr(status->name));
+  rb_hash_aset(rb_process, ID2SYM(rb_intern("uid")), LONG2NUM(status->uid));
+  rb_hash_aset(rb_process, ID2SYM(rb_intern("effective")), ULL2NUM(status->sets.effective));
+  rb_hash_aset(rb_process, ID2SYM(rb_intern("permitted")), ULL2NUM(status->sets.permitted));
+  rb_hash_aset(
+    rb_process, ID2SYM(rb_intern("inheritable")), ULL2NUM(status->sets.inheritable));
+  rb_hash_aset(rb_process, ID2SYM(rb_intern("bounding")), ULL2NUM(status->sets.bounding));
+  rb_hash_aset(rb_process, ID2SYM(rb_intern("ambient")), ULL2NUM(status->sets.ambient));
+
+  return rb_yield(rb_process);
+}
+
+static VALUE
+capng_each_process_perform(VALUE arg)
+{
+  struct CapNGEachProcess* each = (struct CapNGEachProcess*)arg;
+  char path[64];
+  long n = 0;
+
+  while ((n = syscall(SYS_getdents64, each->fd, each->dirents, EACH_DIRENT_BATCH_SIZE)) > 0) {
+    for (long offset = 0; offset < n;) {
+      struct CapNGDirent64* entry = (struct CapNGDirent64*)(each->dirents + offset);
+      char* end = NULL;
+      long pid = 0;
+      ProcStatus status;
+
+      offset += entry->d_reclen;
+      pid = strtol(entry->d_name, &end, 10);
+      if (*end != '\0' || pid <= 0)
+        continue;
+
+      snprintf(path, sizeof(path), "/proc/%ld/status", pid);
+      if (read_proc_status(path, &status, each->status_buffer, sizeof(each->status_buffer)) !=
+            0 ||
+          !(status.found & PROC_STATUS_EFFECTIVE))
+        continue;
+      if ((capability_sets_mask(&status.sets, each->type) & each->filter) != each->filter)
+        continue;
+
+      capng_each_process_yield((int)pid, &status);
+    }
+  }
+  if (n < 0)
+    rb_sys_fail("getdents64");
+
+  return Qnil;
+}
+
+static VALUE
+capng_each_process_release(VALUE arg)
+{
+  capng_each_process_close((struct CapNGEachProcess*)arg);
+
+  return Qnil;
+}
+
+/*
+ * Iterate over processes whose capabilities include the filter.
+ *
+ * @overload each_process_raw(filter, type)
+ *   @param filter [Array, Symbol, String, Integer, Hash, nil] Capabilities
+ *     (names or constants) or {mask: Integer} which must all be held. nil
+ *     matches every process.
+ *   @param type [Symbol, String, Integer] :effective, :permitted,
+ *     :inheritable, :bounding_set or :ambient.
+ *
+ * @yield [Hash] pid, name, uid and the capability masks of a process.
+ * @return [nil]
+ *
+ * @!visibility private
+ */
+static VALUE
+rb_capng_s_each_process_raw(VALUE self, VALUE rb_filter, VALUE rb_type)
+{
+  VALUE rb_each = Qnil;
+  struct CapNGEachProcess* each = NULL;
+  uint64_t filter = 0;
+  capng_type_t type = value_to_capability_type(rb_type);
+
+  rb_need_block();
+  if (!NIL_P(rb_filter))
+    filter = value_to_requested_mask(rb_filter);
+  /* Raise for combined types before opening anything. */
+  {
+    CapabilitySets sets;
+    memset(&sets, 0, sizeof(sets));
+    capability_sets_mask(&sets, type);
+  }
+
+  /* Owned by a GC object: the iteration may run in the Fiber of an
+   * external enumerator which is never resumed, so rb_ensure() alone
+   * can't promise the descriptor is closed. */
+  rb_each =
+    TypedData_Make_Struct(0, struct CapNGEachProcess, &rb_capng_each_process_type, each);
+  each->fd = -1;
+  each->filter = filter;
+  each->type = type;
+  each->dirents = ALLOC_N(char, EACH_DIRENT_BATCH_SIZE);
+  each->fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (each->fd < 0)
+    rb_sys_fail("/proc");
+
+  rb_ensure(capng_each_process_perform,
+            (VALUE)each,
+            capng_each_process_release,
+            (VALUE)each);
+  RB_GC_GUARD(rb_each);
+
+  return Qnil;
+}
+
+void
+Init_capng_each(VALUE rb_cCapNG)
+{
+  rb_define_singleton_method(
+    rb_cCapNG, "each_process_raw", rb_capng_s_each_process_raw, 2);
+}
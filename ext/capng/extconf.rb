@@ -35,4 +35,9 @@ have_const("CAPNG_INIT_SUPP_GRP", "cap-ng.h")
 have_func("rb_sym2str", "ruby.h")
 have_func("rb_io_descriptor", "ruby.h")
 have_func("capng_get_caps_fd", "cap-ng.h")
+have_func("rb_ext_ractor_safe", "ruby.h")
+have_func("rb_ractor_local_storage_ptr_newkey", "ruby/ractor.h")
+have_const("RUBY_TYPED_EMBEDDABLE", "ruby.h")
+have_func("rb_gc_mark_movable", "ruby.h")
+have_func("malloc_usable_size", "malloc.h")
 create_makefile("capng/capng")
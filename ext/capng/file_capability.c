@@ -0,0 +1,361 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+
+/* clang-format off */
+/*
+ * Document-class: CapNG::FileCapability
+ *
+ * File capabilities read straight from the security.capability extended
+ * attribute.
+ *
+ * Unlike CapNG#caps_file, reading them needs no File object and leaves
+ * libcap-ng's state untouched. Instances are immutable values.
+ *
+ * @example
+ *  require 'capng'
+ *
+ *  caps = CapNG.file_caps("/usr/bin/ping")
+ *  caps.permitted?(:net_raw) #=> true
+ *  caps.effective?           #=> true
+ *  caps.permitted_names      #=> ["net_raw"]
+ */
+/* clang-format on */
+
+#include <capng.h>
+
+#include <errno.h>
+
+struct CapNGFileCapability
+{
+  FileCapabilities caps;
+  int embedded;
+};
+
+static size_t
+capng_file_capability_memsize(const void* ptr)
+{
+  const struct CapNGFileCapability* file_capability = (const struct CapNGFileCapability*)ptr;
+
+  return file_capability->embedded ? 0 : sizeof(struct CapNGFileCapability);
+}
+
+static const rb_data_type_t rb_capng_file_capability_type = {
+  "capng/file_capability",
+  {
+    0,
+    RUBY_TYPED_DEFAULT_FREE,
+    capng_file_capability_memsize,
+  },
+  NULL,
+  NULL,
+  RUBY_TYPED_FREE_IMMEDIATELY | CAPNG_TYPED_EMBEDDABLE
+};
+
+static VALUE rb_cFileCapability;
+
+static FileCapabilities*
+capng_file_capability(VALUE self)
+{
+  struct CapNGFileCapability* file_capability;
+
+  TypedData_Get_Struct(
+    self, struct CapNGFileCapability, &rb_capng_file_capability_type, file_capability);
+
+  return &file_capability->caps;
+}
+
+static VALUE
+capng_mask_names(uint64_t mask)
+{
+  VALUE rb_names = rb_ary_new();
+
+  for (unsigned int i = 0; i <= CAPNG_C_LAST_CAP; i++) {
+    const char* name = NULL;
+    if (!(mask & CAPNG_C_MASK(i)))
+      continue;
+    name = capability_name(i);
+    if (name)
+      rb_ary_push(rb_names, rb_str_new_cstr(name));
+  }
+
+  return rb_names;
+}
+
+/*
+ * Read file capabilities of a path.
+ *
+ * @overload file_caps(path, follow_symlinks: true)
+ *   @param path [String] Target file.
+ *   @param follow_symlinks [Boolean] Read the link itself when false.
+ *
+ * @raise [SystemCallError] The attribute couldn't be read, e.g. Errno::ENOENT.
+ *
+ * @return [CapNG::FileCapability, nil] nil if the file has no capabilities.
+ *
+ */
+static VALUE
+rb_capng_s_file_caps(int argc, VALUE* argv, VALUE self)
+{
+  static ID keyword_ids[1];
+  VALUE rb_path, rb_options, kwargs[1];
+  VALUE rb_caps = Qnil;
+  struct CapNGFileCapability* file_capability = NULL;
+  FileCapabilities read;
+  int follow_symlinks = 1;
+
+  if (!keyword_ids[0]) {
+    keyword_ids[0] = rb_intern("follow_symlinks");
+  }
+
+  rb_scan_args(argc, argv, "1:", &rb_path, &rb_options);
+  rb_get_kwargs(rb_options, keyword_ids, 0, 1, kwargs);
+  if (kwargs[0] != Qundef)
+    follow_symlinks = RTEST(kwargs[0]);
+
+  FilePathValue(rb_path);
+  if (read_file_capabilities(StringValueCStr(rb_path), follow_symlinks, &read) != 0) {
+    if (errno == ENODATA)
+      return Qnil;
+    rb_syserr_fail_str(errno, rb_path);
+  }
+
+  rb_caps = TypedData_Make_Struct(rb_cFileCapability,
+                                  struct CapNGFileCapability,
+                                  &rb_capng_file_capability_type,
+                                  file_capability);
+  file_capability->caps = read;
+  file_capability->embedded = CAPNG_TYPED_EMBEDDED_P(rb_caps);
+
+  return rb_obj_freeze(rb_caps);
+}
+
+/*
+ * On-disk revision of the attribute.
+ *
+ * @return [Integer] 1, 2 or 3.
+ *
+ */
+static VALUE
+rb_capng_file_capability_version(VALUE self)
+{
+  return INT2NUM(capng_file_capability(self)->version);
+}
+
+/*
+ * Whether permitted capabilities are raised into the effective set on
+ * execve(2).
+ *
+ * @return [Boolean]
+ *
+ */
+static VALUE
+rb_capng_file_capability_effective_p(VALUE self)
+{
+  return capng_file_capability(self)->effective ? Qtrue : Qfalse;
+}
+
+/*
+ * Permitted capabilities as a mask.
+ *
+ * @return [Integer]
+ *
+ */
+static VALUE
+rb_capng_file_capability_permitted(VALUE self)
+{
+  return ULL2NUM(capng_file_capability(self)->permitted);
+}
+
+/*
+ * Inheritable capabilities as a mask.
+ *
+ * @return [Integer]
+ *
+ */
+static VALUE
+rb_capng_file_capability_inheritable(VALUE self)
+{
+  return ULL2NUM(capng_file_capability(self)->inheritable);
+}
+
+/*
+ * User namespace root uid the capabilities are bound to.
+ *
+ * @return [Integer, nil] nil unless the attribute is revision 3.
+ *
+ */
+static VALUE
+rb_capng_file_capability_rootid(VALUE self)
+{
+  FileCapabilities* caps = capng_file_capability(self);
+
+  if (caps->version != FILE_CAPS_REVISION_3)
+    return Qnil;
+
+  return UINT2NUM(caps->rootid);
+}
+
+/*
+ * Check whether all given capabilities are permitted.
+ *
+ * @param rb_capabilities [Array or Symbol or String or Fixnum]
+ *
+ * @return [Boolean]
+ *
+ */
+static VALUE
+rb_capng_file_capability_permitted_p(VALUE self, VALUE rb_capabilities)
+{
+  uint64_t mask = value_to_capability_mask(rb_capabilities);
+
+  return (capng_file_capability(self)->permitted & mask) == mask ? Qtrue : Qfalse;
+}
+
+/*
+ * Check whether all given capabilities are inheritable.
+ *
+ * @param rb_capabilities [Array or Symbol or String or Fixnum]
+ *
+ * @return [Boolean]
+ *
+ */
+static VALUE
+rb_capng_file_capability_inheritable_p(VALUE self, VALUE rb_capabilities)
+{
+  uint64_t mask = value_to_capability_mask(rb_capabilities);
+
+  return (capng_file_capability(self)->inheritable & mask) == mask ? Qtrue : Qfalse;
+}
+
+/*
+ * Names of the permitted capabilities.
+ *
+ * @return [Array<String>]
+ *
+ */
+static VALUE
+rb_capng_file_capability_permitted_names(VALUE self)
+{
+  return capng_mask_names(capng_file_capability(self)->permitted);
+}
+
+/*
+ * Names of the inheritable capabilities.
+ *
+ * @return [Array<String>]
+ *
+ */
+static VALUE
+rb_capng_file_capability_inheritable_names(VALUE self)
+{
+  return capng_mask_names(capng_file_capability(self)->inheritable);
+}
+
+/*
+ * @return [Hash] version, effective, permitted, inheritable and rootid.
+ *
+ */
+static VALUE
+rb_capng_file_capability_to_h(VALUE self)
+{
+  VALUE rb_hash = rb_hash_new();
+
+  rb_hash_aset(rb_hash, ID2SYM(rb_intern("version")), rb_capng_file_capability_version(self));
+  rb_hash_aset(
+    rb_hash, ID2SYM(rb_intern("effective")), rb_capng_file_capability_effective_p(self));
+  rb_hash_aset(
+    rb_hash, ID2SYM(rb_intern("permitted")), rb_capng_file_capability_permitted(self));
+  rb_hash_aset(
+    rb_hash, ID2SYM(rb_intern("inheritable")), rb_capng_file_capability_inheritable(self));
+  rb_hash_aset(rb_hash, ID2SYM(rb_intern("rootid")), rb_capng_file_capability_rootid(self));
+
+  return rb_hash;
+}
+
+/*
+ * Compare the decoded attributes.
+ *
+ * @param other [Object]
+ *
+ * @return [Boolean] true for a FileCapability with the same values.
+ *
+ */
+static VALUE
+rb_capng_file_capability_eq(VALUE self, VALUE other)
+{
+  FileCapabilities* caps = NULL;
+  FileCapabilities* other_caps = NULL;
+
+  if (!rb_typeddata_is_kind_of(other, &rb_capng_file_capability_type))
+    return Qfalse;
+
+  caps = capng_file_capability(self);
+  other_caps = capng_file_capability(other);
+
+  return (caps->version == other_caps->version && caps->effective == other_caps->effective &&
+          caps->permitted == other_caps->permitted &&
+          caps->inheritable == other_caps->inheritable &&
+          caps->rootid == other_caps->rootid)
+           ? Qtrue
+           : Qfalse;
+}
+
+/*
+ * A hash over the same values as #==, so equal instances collapse as Hash
+ * keys and under Array#uniq.
+ *
+ * @return [Integer]
+ *
+ */
+static VALUE
+rb_capng_file_capability_hash(VALUE self)
+{
+  FileCapabilities* caps = capng_file_capability(self);
+  st_index_t hash = rb_hash_start((st_index_t)caps->version);
+
+  hash = rb_hash_uint(hash, (st_index_t)caps->effective);
+  hash = rb_hash_uint(hash, (st_index_t)caps->permitted);
+  hash = rb_hash_uint(hash, (st_index_t)caps->inheritable);
+  hash = rb_hash_uint(hash, (st_index_t)caps->rootid);
+
+  return ST2FIX(rb_hash_end(hash));
+}
+
+void
+Init_capng_file_capability(VALUE rb_cCapNG)
+{
+  rb_cFileCapability = rb_define_class_under(rb_cCapNG, "FileCapability", rb_cObject);
+  rb_undef_alloc_func(rb_cFileCapability);
+
+  rb_define_singleton_method(rb_cCapNG, "file_caps", rb_capng_s_file_caps, -1);
+
+  rb_define_method(rb_cFileCapability, "version", rb_capng_file_capability_version, 0);
+  rb_define_method(rb_cFileCapability, "effective?", rb_capng_file_capability_effective_p, 0);
+  rb_define_method(rb_cFileCapability, "permitted", rb_capng_file_capability_permitted, 0);
+  rb_define_method(
+    rb_cFileCapability, "inheritable", rb_capng_file_capability_inheritable, 0);
+  rb_define_method(rb_cFileCapability, "rootid", rb_capng_file_capability_rootid, 0);
+  rb_define_method(
+    rb_cFileCapability, "permitted?", rb_capng_file_capability_permitted_p, 1);
+  rb_define_method(
+    rb_cFileCapability, "inheritable?", rb_capng_file_capability_inheritable_p, 1);
+  rb_define_method(
+    rb_cFileCapability, "permitted_names", rb_capng_file_capability_permitted_names, 0);
+  rb_define_method(
+    rb_cFileCapability, "inheritable_names", rb_capng_file_capability_inheritable_names, 0);
+  rb_define_method(rb_cFileCapability, "to_h", rb_capng_file_capability_to_h, 0);
+  rb_define_method(rb_cFileCapability, "==", rb_capng_file_capability_eq, 1);
+  rb_define_method(rb_cFileCapability, "eql?", rb_capng_file_capability_eq, 1);
+  rb_define_method(rb_cFileCapability, "hash", rb_capng_file_capability_hash, 0);
+}
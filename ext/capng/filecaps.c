@@ -0,0 +1,105 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+
+/* Decoder for the "security.capability" extended attribute (struct
+ * vfs_cap_data / vfs_ns_cap_data). It only reads the attribute, so it
+ * works without libcap-ng's file capability support. */
+
+#include <capng.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/xattr.h>
+
+#define FILE_CAPS_XATTR_NAME "security.capability"
+#define FILE_CAPS_REVISION_MASK 0xFF000000U
+#define FILE_CAPS_REVISION_SHIFT 24
+#define FILE_CAPS_FLAGS_EFFECTIVE 0x000001U
+#define FILE_CAPS_XATTR_MAX_SIZE 24
+
+static uint32_t
+read_le32(const unsigned char* p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
+
+/* Returns 0 on success, or -1 with errno set to EINVAL for a malformed
+ * attribute. */
+int
+decode_file_capabilities(const void* data, size_t size, FileCapabilities* caps)
+{
+  const unsigned char* p = (const unsigned char*)data;
+  uint32_t magic_etc = 0;
+  size_t expected = 0;
+  int words = 0;
+
+  memset(caps, 0, sizeof(*caps));
+  if (size < 4) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  magic_etc = read_le32(p);
+  caps->version = (int)((magic_etc & FILE_CAPS_REVISION_MASK) >> FILE_CAPS_REVISION_SHIFT);
+  switch (caps->version) {
+    case FILE_CAPS_REVISION_1:
+      words = 1;
+      expected = 12;
+      break;
+    case FILE_CAPS_REVISION_2:
+      words = 2;
+      expected = 20;
+      break;
+    case FILE_CAPS_REVISION_3:
+      words = 2;
+      expected = 24;
+      break;
+    default:
+      errno = EINVAL;
+      return -1;
+  }
+  if (size < expected) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  caps->effective = (magic_etc & FILE_CAPS_FLAGS_EFFECTIVE) ? 1 : 0;
+  for (int i = 0; i < words; i++) {
+    caps->permitted |= (uint64_t)read_le32(p + 4 + i * 8) << (32 * i);
+    caps->inheritable |= (uint64_t)read_le32(p + 8 + i * 8) << (32 * i);
+  }
+  if (caps->version == FILE_CAPS_REVISION_3)
+    caps->rootid = read_le32(p + 20);
+
+  return 0;
+}
+
+/* Returns 0 on success, or -1 with errno set. A file without file
+ * capabilities fails with ENODATA. */
+int
+read_file_capabilities(const char* path, int follow_symlinks, FileCapabilities* caps)
+{
+  unsigned char data[FILE_CAPS_XATTR_MAX_SIZE];
+  ssize_t size = 0;
+
+  if (follow_symlinks)
+    size = getxattr(path, FILE_CAPS_XATTR_NAME, data, sizeof(data));
+  else
+    size = lgetxattr(path, FILE_CAPS_XATTR_NAME, data, sizeof(data));
+  if (size < 0)
+    return -1;
+
+  return decode_file_capabilities(data, (size_t)size, caps);
+}
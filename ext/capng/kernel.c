@@ -0,0 +1,143 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+/* Thin wrappers around capability related system calls. They neither
+ * allocate nor touch libcap-ng's state, so that they can also be used in
+ * a child process between fork(2) and execve(2). */
+
+#include <capng.h>
+
+#include <errno.h>
+#include <linux/capability.h>
+#include <linux/securebits.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int
+kernel_capget(int tid, KernelCapabilities* caps)
+{
+  struct __user_cap_header_struct header = { _LINUX_CAPABILITY_VERSION_3, tid };
+  struct __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3];
+
+  if (syscall(SYS_capget, &header, data) != 0)
+    return -1;
+
+  caps->effective = ((uint64_t)data[1].effective << 32) | data[0].effective;
+  caps->permitted = ((uint64_t)data[1].permitted << 32) | data[0].permitted;
+  caps->inheritable = ((uint64_t)data[1].inheritable << 32) | data[0].inheritable;
+
+  return 0;
+}
+
+int
+kernel_capset(const KernelCapabilities* caps)
+{
+  struct __user_cap_header_struct header = { _LINUX_CAPABILITY_VERSION_3, 0 };
+  struct __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3];
+
+  data[0].effective = (uint32_t)caps->effective;
+  data[0].permitted = (uint32_t)caps->permitted;
+  data[0].inheritable = (uint32_t)caps->inheritable;
+  data[1].effective = (uint32_t)(caps->effective >> 32);
+  data[1].permitted = (uint32_t)(caps->permitted >> 32);
+  data[1].inheritable = (uint32_t)(caps->inheritable >> 32);
+
+  return syscall(SYS_capset, &header, data) == 0 ? 0 : -1;
+}
+
+int
+kernel_set_ambient(uint64_t ambient)
+{
+#if defined(PR_CAP_AMBIENT)
+  if (prctl(PR_CAP_AMBIENT, PR_CAP_AMBIENT_CLEAR_ALL, 0, 0, 0) != 0)
+    return -1;
+
+  for (unsigned int capability = 0; capability <= CAPNG_C_LAST_CAP; capability++) {
+    if (!(ambient & CAPNG_C_MASK(capability)))
+      continue;
+    if (prctl(PR_CAP_AMBIENT, PR_CAP_AMBIENT_RAISE, capability, 0, 0) != 0)
+      return -1;
+  }
+
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/* Drop every capability outside keep from the bounding set. */
+int
+kernel_drop_bounding(uint64_t keep)
+{
+  for (unsigned int capability = 0; capability <= CAPNG_C_LAST_CAP; capability++) {
+    int held = prctl(PR_CAPBSET_READ, capability, 0, 0, 0);
+    if (held < 0)
+      break; /* Beyond the last capability the kernel knows. */
+    if (!held || (keep & CAPNG_C_MASK(capability)))
+      continue;
+    if (prctl(PR_CAPBSET_DROP, capability, 0, 0, 0) != 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+/* The same securebits as capng_lock(). */
+int
+kernel_lock_securebits(void)
+{
+  return prctl(PR_SET_SECUREBITS,
+               SECBIT_NOROOT | SECBIT_NOROOT_LOCKED | SECBIT_NO_SETUID_FIXUP |
+                 SECBIT_NO_SETUID_FIXUP_LOCKED,
+               0,
+               0,
+               0);
+}
+
+int
+kernel_set_keepcaps(int keep)
+{
+  return prctl(PR_SET_KEEPCAPS, keep, 0, 0, 0);
+}
+
+int
+kernel_gettid(void)
+{
+  return (int)syscall(SYS_gettid);
+}
+
+int
+kernel_pidfd_open(int pid)
+{
+#if defined(SYS_pidfd_open)
+  return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+int
+kernel_pidfd_alive(int pidfd)
+{
+#if defined(SYS_pidfd_send_signal)
+  /* Signal 0 only checks for existence; EPERM still means it is alive. */
+  if (syscall(SYS_pidfd_send_signal, pidfd, 0, NULL, 0) == 0 || errno == EPERM)
+    return 1;
+  return 0;
+#else
+  return 1;
+#endif
+}
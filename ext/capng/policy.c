@@ -0,0 +1,344 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+
+/* clang-format off */
+/*
+ * Document-class: CapNG::Policy
+ *
+ * A set of capabilities resolved once into native masks.
+ *
+ * A compiled policy can be applied to the calling thread, checked against
+ * it, or written to files any number of times without resolving names
+ * again.
+ *
+ * @example
+ *  require 'capng'
+ *
+ *  POLICY = CapNG::Policy.compile(effective: [:net_bind_service],
+ *                                 permitted: [:net_bind_service, :dac_read_search])
+ *  MASKED = CapNG::Policy.compile(effective: {mask: CapNG::Capability.mask(:kill)})
+ *  POLICY.apply
+ *  POLICY.check #=> true
+ *  POLICY.apply_to_file("/usr/local/bin/worker")
+ */
+/* clang-format on */
+
+#include <capng.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+#define POLICY_EFFECTIVE 0x01
+#define POLICY_PERMITTED 0x02
+#define POLICY_INHERITABLE 0x04
+#define POLICY_BOUNDING 0x08
+#define POLICY_AMBIENT 0x10
+#define POLICY_CAPS (POLICY_EFFECTIVE | POLICY_PERMITTED | POLICY_INHERITABLE)
+
+struct CapNGPolicy
+{
+  CapabilitySets sets;
+  int given;
+  int embedded;
+};
+
+static size_t
+capng_policy_memsize(const void* ptr)
+{
+  const struct CapNGPolicy* policy = (const struct CapNGPolicy*)ptr;
+
+  return policy->embedded ? 0 : sizeof(struct CapNGPolicy);
+}
+
+static const rb_data_type_t rb_capng_policy_type = {
+  "capng/policy",
+  {
+    0,
+    RUBY_TYPED_DEFAULT_FREE,
+    capng_policy_memsize,
+  },
+  NULL,
+  NULL,
+  RUBY_TYPED_FREE_IMMEDIATELY | CAPNG_TYPED_EMBEDDABLE
+};
+
+static struct CapNGPolicy*
+capng_policy(VALUE self)
+{
+  struct CapNGPolicy* policy;
+
+  TypedData_Get_Struct(self, struct CapNGPolicy, &rb_capng_policy_type, policy);
+
+  return policy;
+}
+
+/*
+ * Resolve capabilities into a policy.
+ *
+ * Sets which are not given are left as they are by #apply and ignored by
+ * #check. Each set accepts a capability, an Array of capabilities, or a
+ * mask built by CapNG::Capability.mask wrapped as +{mask: Integer}+. A
+ * bare Integer is a capability constant, never a mask.
+ *
+ * @overload compile(effective: nil, permitted: nil, inheritable: nil, bounding: nil, ambient: nil)
+ *
+ * @raise [ArgumentError] A set is not one of the forms above.
+ *
+ * @return [CapNG::Policy] A frozen policy.
+ *
+ */
+static VALUE
+rb_capng_policy_s_compile(int argc, VALUE* argv, VALUE klass)
+{
+  static ID keyword_ids[5];
+  VALUE rb_options, kwargs[5];
+  VALUE rb_policy = Qnil;
+  struct CapNGPolicy* policy = NULL;
+  uint64_t* masks[5];
+
+  if (!keyword_ids[0]) {
+    keyword_ids[0] = rb_intern("effective");
+    keyword_ids[1] = rb_intern("permitted");
+    keyword_ids[2] = rb_intern("inheritable");
+    keyword_ids[3] = rb_intern("bounding");
+    keyword_ids[4] = rb_intern("ambient");
+  }
+
+  rb_scan_args(argc, argv, ":", &rb_options);
+  rb_get_kwargs(rb_options, keyword_ids, 0, 5, kwargs);
+
+  rb_policy = TypedData_Make_Struct(klass, struct CapNGPolicy, &rb_capng_policy_type, policy);
+  policy->embedded = CAPNG_TYPED_EMBEDDED_P(rb_policy);
+  masks[0] = &policy->sets.effective;
+  masks[1] = &policy->sets.permitted;
+  masks[2] = &policy->sets.inheritable;
+  masks[3] = &policy->sets.bounding;
+  masks[4] = &policy->sets.ambient;
+  for (int i = 0; i < 5; i++) {
+    if (kwargs[i] == Qundef || NIL_P(kwargs[i]))
+      continue;
+    *masks[i] = value_to_requested_mask(kwargs[i]);
+    policy->given |= 1 << i;
+  }
+
+#if !defined(HAVE_CONST_CAPNG_SELECT_AMBIENT) || !defined(HAVE_CONST_CAPNG_AMBIENT)
+  if (policy->given & POLICY_AMBIENT)
+    rb_raise(rb_eArgError, "Ambient capabilities are not supported by this libcap-ng");
+#endif
+
+  return rb_obj_freeze(rb_policy);
+}
+
+/*
+ * Apply the policy to the calling thread.
+ *
+ * @return [Boolean]
+ *
+ */
+static VALUE
+rb_capng_policy_apply(VALUE self)
+{
+  struct CapNGPolicy* policy = capng_policy(self);
+  /* Sets which are not given keep their current values, also in
+   * libcap-ng's state left behind for later calls. */
+  CapabilitySets sets = *current_capability_sets(1);
+  capng_select_t select = 0;
+  int result = 0;
+
+  if (policy->given & POLICY_EFFECTIVE)
+    sets.effective = policy->sets.effective;
+  if (policy->given & POLICY_PERMITTED)
+    sets.permitted = policy->sets.permitted;
+  if (policy->given & POLICY_INHERITABLE)
+    sets.inheritable = policy->sets.inheritable;
+  if (policy->given & POLICY_BOUNDING)
+    sets.bounding = policy->sets.bounding;
+  if (policy->given & POLICY_AMBIENT)
+    sets.ambient = policy->sets.ambient;
+
+  if (policy->given & POLICY_CAPS)
+    select |= CAPNG_SELECT_CAPS;
+  if (policy->given & POLICY_BOUNDING)
+    select |= CAPNG_SELECT_BOUNDS;
+#if defined(HAVE_CONST_CAPNG_SELECT_AMBIENT)
+  if (policy->given & POLICY_AMBIENT)
+    select |= CAPNG_SELECT_AMBIENT;
+#endif
+  if (!select)
+    return Qtrue;
+
+  ractor_state_enter();
+  capng_setpid(kernel_gettid());
+  ractor_state_setpid(0);
+  load_capability_sets(&sets);
+  result = apply_capabilities(select);
+  ractor_state_leave();
+
+  if (result == 0)
+    return Qtrue;
+  else
+    return Qfalse;
+}
+
+/*
+ * Check whether the calling thread holds every capability of the policy.
+ *
+ * @return [Boolean]
+ *
+ */
+static VALUE
+rb_capng_policy_check(VALUE self)
+{
+  struct CapNGPolicy* policy = capng_policy(self);
+  const CapabilitySets* current = current_capability_sets(policy->given & ~POLICY_CAPS);
+
+  if ((policy->given & POLICY_EFFECTIVE) &&
+      (current->effective & policy->sets.effective) != policy->sets.effective)
+    return Qfalse;
+  if ((policy->given & POLICY_PERMITTED) &&
+      (current->permitted & policy->sets.permitted) != policy->sets.permitted)
+    return Qfalse;
+  if ((policy->given & POLICY_INHERITABLE) &&
+      (current->inheritable & policy->sets.inheritable) != policy->sets.inheritable)
+    return Qfalse;
+  if ((policy->given & POLICY_BOUNDING) &&
+      (current->bounding & policy->sets.bounding) != policy->sets.bounding)
+    return Qfalse;
+  if ((policy->given & POLICY_AMBIENT) &&
+      (current->ambient & policy->sets.ambient) != policy->sets.ambient)
+    return Qfalse;
+
+  return Qtrue;
+}
+
+/*
+ * Write the permitted and inheritable sets of the policy to a file as
+ * file capabilities. The effective flag is set when the effective set is
+ * not empty. libcap-ng's state of the calling thread is kept.
+ *
+ * @param rb_file_or_path [File or String]
+ *
+ * @return [Boolean]
+ *
+ */
+static VALUE
+rb_capng_policy_apply_to_file(VALUE self, VALUE rb_file_or_path)
+{
+  struct CapNGPolicy* policy = capng_policy(self);
+  CapabilitySets sets = { 0 };
+  void* saved = NULL;
+  int fd = -1, opened = 0, result = 0;
+
+  if (RB_TYPE_P(rb_file_or_path, T_FILE)) {
+    fd = capng_get_file_descriptor(rb_file_or_path);
+  } else {
+    FilePathValue(rb_file_or_path);
+    fd = open(StringValueCStr(rb_file_or_path), O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0)
+      rb_syserr_fail_str(errno, rb_file_or_path);
+    opened = 1;
+  }
+
+  sets.effective = policy->sets.effective;
+  sets.permitted = policy->sets.permitted;
+  sets.inheritable = policy->sets.inheritable;
+
+  ractor_state_enter();
+  saved = capng_save_state();
+  load_capability_sets(&sets);
+  result = capng_apply_caps_fd(fd);
+  capng_restore_state(&saved);
+  ractor_state_leave();
+
+  if (opened)
+    close(fd);
+
+  if (result == 0)
+    return Qtrue;
+  else
+    return Qfalse;
+}
+
+static VALUE
+capng_policy_mask(VALUE self, int flag, uint64_t mask)
+{
+  if (!(capng_policy(self)->given & flag))
+    return Qnil;
+
+  return ULL2NUM(mask);
+}
+
+/*
+ * @return [Integer, nil] The effective mask, or nil if not given.
+ */
+static VALUE
+rb_capng_policy_effective(VALUE self)
+{
+  return capng_policy_mask(self, POLICY_EFFECTIVE, capng_policy(self)->sets.effective);
+}
+
+/*
+ * @return [Integer, nil] The permitted mask, or nil if not given.
+ */
+static VALUE
+rb_capng_policy_permitted(VALUE self)
+{
+  return capng_policy_mask(self, POLICY_PERMITTED, capng_policy(self)->sets.permitted);
+}
+
+/*
+ * @return [Integer, nil] The inheritable mask, or nil if not given.
+ */
+static VALUE
+rb_capng_policy_inheritable(VALUE self)
+{
+  return capng_policy_mask(self, POLICY_INHERITABLE, capng_policy(self)->sets.inheritable);
+}
+
+/*
+ * @return [Integer, nil] The bounding set mask, or nil if not given.
+ */
+static VALUE
+rb_capng_policy_bounding(VALUE self)
+{
+  return capng_policy_mask(self, POLICY_BOUNDING, capng_policy(self)->sets.bounding);
+}
+
+/*
+ * @return [Integer, nil] The ambient mask, or nil if not given.
+ */
+static VALUE
+rb_capng_policy_ambient(VALUE self)
+{
+  return capng_policy_mask(self, POLICY_AMBIENT, capng_policy(self)->sets.ambient);
+}
+
+void
+Init_capng_policy(VALUE rb_cCapNG)
+{
+  VALUE rb_cPolicy = rb_define_class_under(rb_cCapNG, "Policy", rb_cObject);
+
+  rb_undef_alloc_func(rb_cPolicy);
+
+  rb_define_singleton_method(rb_cPolicy, "compile", rb_capng_policy_s_compile, -1);
+
+  rb_define_method(rb_cPolicy, "apply", rb_capng_policy_apply, 0);
+  rb_define_method(rb_cPolicy, "check", rb_capng_policy_check, 0);
+  rb_define_method(rb_cPolicy, "apply_to_file", rb_capng_policy_apply_to_file, 1);
+  rb_define_method(rb_cPolicy, "effective", rb_capng_policy_effective, 0);
+  rb_define_method(rb_cPolicy, "permitted", rb_capng_policy_permitted, 0);
+  rb_define_method(rb_cPolicy, "inheritable", rb_capng_policy_inheritable, 0);
+  rb_define_method(rb_cPolicy, "bounding", rb_capng_policy_bounding, 0);
+  rb_define_method(rb_cPolicy, "ambient", rb_capng_policy_ambient, 0);
+}
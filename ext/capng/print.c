@@ -27,36 +27,187 @@
 
 #include <capng.h>
 
-struct CapNGPrint
-{};
+#if defined(HAVE_RB_RACTOR_LOCAL_STORAGE_PTR_NEWKEY)
+#include <ruby/ractor.h>
+#endif
+
+/* Rendered texts of recently printed (type, mask) pairs. A fleet only has
+ * a handful of distinct capability sets, so a small LRU avoids running
+ * libcap-ng's formatter over and over. Each Ractor has its own cache. */
+#define PRINT_CACHE_SIZE 64
+
+struct CapNGPrintCacheEntry
+{
+  uint64_t mask;
+  capng_type_t type;
+  unsigned long used;
+  VALUE text;
+};
+
+struct CapNGPrintCache
+{
+  unsigned long clock;
+  struct CapNGPrintCacheEntry entries[PRINT_CACHE_SIZE];
+};
 
 static void
-capng_print_free(void* capng);
+capng_print_cache_mark(void* ptr)
+{
+  struct CapNGPrintCache* cache = (struct CapNGPrintCache*)ptr;
+
+  for (int i = 0; i < PRINT_CACHE_SIZE; i++) {
+#if defined(HAVE_RB_GC_MARK_MOVABLE)
+    rb_gc_mark_movable(cache->entries[i].text);
+#else
+    rb_gc_mark(cache->entries[i].text);
+#endif
+  }
+}
+
+#if defined(HAVE_RB_GC_MARK_MOVABLE)
+static void
+capng_print_cache_compact(void* ptr)
+{
+  struct CapNGPrintCache* cache = (struct CapNGPrintCache*)ptr;
+
+  for (int i = 0; i < PRINT_CACHE_SIZE; i++) {
+    cache->entries[i].text = rb_gc_location(cache->entries[i].text);
+  }
+}
+#endif
+
+static size_t
+capng_print_cache_memsize(const void* ptr)
+{
+  return sizeof(struct CapNGPrintCache);
+}
+
+static const rb_data_type_t rb_capng_print_cache_type = {
+  "capng/print_cache",
+  {
+    capng_print_cache_mark,
+    RUBY_TYPED_DEFAULT_FREE,
+    capng_print_cache_memsize,
+#if defined(HAVE_RB_GC_MARK_MOVABLE)
+    capng_print_cache_compact,
+#endif
+  },
+  NULL,
+  NULL,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+#if defined(HAVE_RB_RACTOR_LOCAL_STORAGE_PTR_NEWKEY)
+static rb_ractor_local_key_t capng_print_cache_key;
+#else
+static VALUE capng_print_cache_object = Qnil;
+#endif
+
+static VALUE
+capng_print_cache_new(void)
+{
+  struct CapNGPrintCache* cache;
+  VALUE obj = TypedData_Make_Struct(0, struct CapNGPrintCache, &rb_capng_print_cache_type, cache);
+
+  for (int i = 0; i < PRINT_CACHE_SIZE; i++) {
+    cache->entries[i].text = Qnil;
+  }
+
+  return obj;
+}
+
+static VALUE
+capng_print_cache(void)
+{
+#if defined(HAVE_RB_RACTOR_LOCAL_STORAGE_PTR_NEWKEY)
+  VALUE obj = Qnil;
+
+  if (!rb_ractor_local_storage_value_lookup(capng_print_cache_key, &obj)) {
+    obj = capng_print_cache_new();
+    rb_ractor_local_storage_value_set(capng_print_cache_key, obj);
+  }
+
+  return obj;
+#else
+  if (NIL_P(capng_print_cache_object)) {
+    capng_print_cache_object = capng_print_cache_new();
+    rb_gc_register_address(&capng_print_cache_object);
+  }
+
+  return capng_print_cache_object;
+#endif
+}
+
+static int
+capng_print_cacheable_type(capng_type_t capability_type)
+{
+  switch (capability_type) {
+    case CAPNG_EFFECTIVE:
+    case CAPNG_PERMITTED:
+    case CAPNG_INHERITABLE:
+    case CAPNG_BOUNDING_SET:
+#if defined(HAVE_CONST_CAPNG_AMBIENT)
+    case CAPNG_AMBIENT:
+#endif
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static VALUE
+capng_print_cache_lookup(VALUE rb_cache, capng_type_t capability_type, uint64_t mask)
+{
+  struct CapNGPrintCache* cache = RTYPEDDATA_DATA(rb_cache);
+
+  for (int i = 0; i < PRINT_CACHE_SIZE; i++) {
+    struct CapNGPrintCacheEntry* entry = &cache->entries[i];
+    if (!NIL_P(entry->text) && entry->type == capability_type && entry->mask == mask) {
+      entry->used = ++cache->clock;
+      return entry->text;
+    }
+  }
+
+  return Qnil;
+}
+
+static void
+capng_print_cache_store(VALUE rb_cache, capng_type_t capability_type, uint64_t mask, VALUE text)
+{
+  struct CapNGPrintCache* cache = RTYPEDDATA_DATA(rb_cache);
+  struct CapNGPrintCacheEntry* victim = &cache->entries[0];
+
+  for (int i = 0; i < PRINT_CACHE_SIZE; i++) {
+    struct CapNGPrintCacheEntry* entry = &cache->entries[i];
+    if (NIL_P(entry->text)) {
+      victim = entry;
+      break;
+    }
+    if (entry->used < victim->used)
+      victim = entry;
+  }
+
+  victim->type = capability_type;
+  victim->mask = mask;
+  victim->used = ++cache->clock;
+  RB_OBJ_WRITE(rb_cache, &victim->text, text);
+}
 
 static const rb_data_type_t rb_capng_print_type = { "capng/print",
                                                     {
                                                       0,
-                                                      capng_print_free,
+                                                      0,
                                                       0,
                                                     },
                                                     NULL,
                                                     NULL,
                                                     RUBY_TYPED_FREE_IMMEDIATELY };
 
-static void
-capng_print_free(void* ptr)
-{
-  xfree(ptr);
-}
-
 static VALUE
 rb_capng_print_alloc(VALUE klass)
 {
-  VALUE obj;
-  struct CapNGPrint* capng_print;
-  obj =
-    TypedData_Make_Struct(klass, struct CapNGPrint, &rb_capng_print_type, capng_print);
-  return obj;
+  /* No per-object state, so don't allocate any. */
+  return TypedData_Wrap_Struct(klass, &rb_capng_print_type, NULL);
 }
 
 /*
@@ -121,6 +272,32 @@ rb_capng_print_caps_text(VALUE self, VALUE rb_where_name_or_type,
                "Expected a String or a Symbol instance, or a print type constant");
   }
 
+  if (print_type == CAPNG_PRINT_BUFFER && capng_print_cacheable_type(capability_type)) {
+    VALUE rb_cache = capng_print_cache();
+    VALUE rb_text = Qnil;
+    uint64_t mask = 0;
+
+    ractor_state_enter();
+    mask = capability_mask(capability_type);
+    ractor_state_leave();
+
+    rb_text = capng_print_cache_lookup(rb_cache, capability_type, mask);
+    if (!NIL_P(rb_text))
+      return rb_text;
+
+    ractor_state_enter();
+    result = capng_print_caps_text(CAPNG_PRINT_BUFFER, capability_type);
+    ractor_state_leave();
+
+    rb_text = rb_str_new2(result ? result : "none");
+    free(result);
+    rb_obj_freeze(rb_text);
+    capng_print_cache_store(rb_cache, capability_type, mask, rb_text);
+
+    return rb_text;
+  }
+
+  ractor_state_enter();
   switch (print_type) {
     case CAPNG_PRINT_STDOUT:
       capng_print_caps_text(CAPNG_PRINT_STDOUT, capability_type);
@@ -128,6 +305,7 @@ rb_capng_print_caps_text(VALUE self, VALUE rb_where_name_or_type,
     case CAPNG_PRINT_BUFFER:
       result = capng_print_caps_text(CAPNG_PRINT_BUFFER, capability_type);
   }
+  ractor_state_leave();
 
   if (result) {
     VALUE obj = rb_str_new2(result);
@@ -186,6 +364,7 @@ rb_capng_print_caps_numeric(VALUE self, VALUE rb_where_name_or_type,
                "Expected a String or a Symbol instance, or a capability type constant");
   }
 
+  ractor_state_enter();
   switch (print_type) {
     case CAPNG_PRINT_STDOUT:
       capng_print_caps_numeric(CAPNG_PRINT_STDOUT, select);
@@ -193,6 +372,7 @@ rb_capng_print_caps_numeric(VALUE self, VALUE rb_where_name_or_type,
     case CAPNG_PRINT_BUFFER:
       result = capng_print_caps_numeric(CAPNG_PRINT_BUFFER, select);
   }
+  ractor_state_leave();
 
   if (result) {
     VALUE obj = rb_str_new2(result);
@@ -210,10 +390,18 @@ Init_capng_print(VALUE rb_cCapNG)
 
   rb_define_alloc_func(rb_cCapNGPrint, rb_capng_print_alloc);
 
+#if defined(HAVE_RB_RACTOR_LOCAL_STORAGE_PTR_NEWKEY)
+  capng_print_cache_key = rb_ractor_local_storage_value_newkey();
+#endif
+
   rb_define_method(rb_cCapNGPrint, "initialize", rb_capng_print_initialize, 0);
   rb_define_method(rb_cCapNGPrint, "caps_text", rb_capng_print_caps_text, 2);
   rb_define_method(rb_cCapNGPrint, "caps_numeric", rb_capng_print_caps_numeric, 2);
 
+  rb_define_singleton_method(rb_cCapNGPrint, "caps_text", rb_capng_print_caps_text, 2);
+  rb_define_singleton_method(
+    rb_cCapNGPrint, "caps_numeric", rb_capng_print_caps_numeric, 2);
+
   // capng_print_t enum constants
   /* Print target into STDOUT. */
   rb_define_const(rb_cCapNGPrint, "STDOUT", LONG2NUM(CAPNG_PRINT_STDOUT));
@@ -0,0 +1,421 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+
+/* clang-format off */
+/*
+ * Document-class: CapNG::PrivilegeDrop
+ *
+ * A privilege drop computed once and applied in forked children.
+ *
+ * Everything that needs lookups or allocation is done in #initialize:
+ * the gid and the supplementary groups of the target user (like
+ * capng_change_id() with CAPNG_INIT_SUPP_GRP) and the capability masks.
+ * #apply then only issues setgroups(2), setresgid(2), prctl(2),
+ * setresuid(2) and capset(2) calls, which are cheap in a freshly forked
+ * worker.
+ *
+ * The ids are changed through libc, which applies them to every thread of
+ * the process, including the threads Ruby starts on its own. Capabilities
+ * are per thread: the calling thread keeps the requested ones, while the
+ * other threads lose theirs with the change away from uid 0.
+ *
+ * @example
+ *  require 'capng'
+ *
+ *  DROP = CapNG::PrivilegeDrop.new(uid: "fluentd", keep: [:net_bind_service])
+ *  4.times { DROP.fork { run_worker } }
+ */
+/* clang-format on */
+
+#include <capng.h>
+
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DROP_BOUNDING 0x01
+#define DROP_AMBIENT 0x02
+#define DROP_LOCK 0x04
+
+struct CapNGPrivilegeDrop
+{
+  uid_t uid;
+  gid_t gid;
+  int ngroups; /* -1 leaves the supplementary groups alone */
+  int groups_capacity;
+  gid_t* groups;
+  KernelCapabilities caps;
+  uint64_t bounding;
+  uint64_t ambient;
+  int flags;
+};
+
+static const char* const drop_step_names[] = {
+  "setgroups", "setresgid", "bounding", "securebits",
+  "keepcaps",  "setresuid", "capset",   "ambient",
+};
+
+enum
+{
+  DROP_STEP_SETGROUPS,
+  DROP_STEP_SETRESGID,
+  DROP_STEP_BOUNDING,
+  DROP_STEP_SECUREBITS,
+  DROP_STEP_KEEPCAPS,
+  DROP_STEP_SETRESUID,
+  DROP_STEP_CAPSET,
+  DROP_STEP_AMBIENT,
+};
+
+static void
+capng_privilege_drop_free(void* ptr)
+{
+  struct CapNGPrivilegeDrop* drop = (struct CapNGPrivilegeDrop*)ptr;
+
+  xfree(drop->groups);
+  xfree(drop);
+}
+
+static size_t
+capng_privilege_drop_memsize(const void* ptr)
+{
+  const struct CapNGPrivilegeDrop* drop = (const struct CapNGPrivilegeDrop*)ptr;
+
+  return sizeof(*drop) + (size_t)drop->groups_capacity * sizeof(gid_t);
+}
+
+static const rb_data_type_t rb_capng_privilege_drop_type = {
+  "capng/privilege_drop",
+  {
+    0,
+    capng_privilege_drop_free,
+    capng_privilege_drop_memsize,
+  },
+  NULL,
+  NULL,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+rb_capng_privilege_drop_alloc(VALUE klass)
+{
+  VALUE obj;
+  struct CapNGPrivilegeDrop* drop;
+  obj = TypedData_Make_Struct(
+    klass, struct CapNGPrivilegeDrop, &rb_capng_privilege_drop_type, drop);
+  drop->ngroups = -1;
+  return obj;
+}
+
+static struct CapNGPrivilegeDrop*
+capng_privilege_drop(VALUE self)
+{
+  struct CapNGPrivilegeDrop* drop;
+
+  TypedData_Get_Struct(self, struct CapNGPrivilegeDrop, &rb_capng_privilege_drop_type, drop);
+
+  return drop;
+}
+
+/* Look up a user by name or uid, raising for an unknown name. Returns 0
+ * when found; name may be NULL when it isn't needed. */
+int
+capng_lookup_user(VALUE rb_user, uid_t* uid, gid_t* gid, char* name, size_t size)
+{
+  struct passwd pwd, *result = NULL;
+  const char* user = NULL;
+  long buffer_size = sysconf(_SC_GETPW_R_SIZE_MAX);
+  char* buffer = NULL;
+  int error = 0;
+
+  if (RB_INTEGER_TYPE_P(rb_user))
+    *uid = (uid_t)NUM2UINT(rb_user);
+  else
+    user = StringValueCStr(rb_user);
+  if (buffer_size <= 0)
+    buffer_size = 1024;
+
+  /* Entries served by NSS modules such as LDAP may exceed the hint. */
+  while (1) {
+    buffer = ALLOC_N(char, buffer_size);
+    if (user)
+      error = getpwnam_r(user, &pwd, buffer, (size_t)buffer_size, &result);
+    else
+      error = getpwuid_r(*uid, &pwd, buffer, (size_t)buffer_size, &result);
+    if (error != ERANGE)
+      break;
+    xfree(buffer);
+    buffer_size *= 2;
+  }
+
+  /* POSIX allows these for an entry which doesn't exist. */
+  if (error == ENOENT || error == ESRCH || error == EBADF || error == EPERM)
+    error = 0;
+  if (error) {
+    xfree(buffer);
+    rb_syserr_fail_str(error, rb_obj_as_string(rb_user));
+  }
+  if (!result) {
+    xfree(buffer);
+    if (user)
+      rb_raise(rb_eArgError, "Unknown user: %" PRIsVALUE, rb_user);
+    return -1;
+  }
+
+  *uid = result->pw_uid;
+  *gid = result->pw_gid;
+  if (name)
+    snprintf(name, size, "%s", result->pw_name);
+  xfree(buffer);
+
+  return 0;
+}
+
+static void
+capng_privilege_drop_init_groups(struct CapNGPrivilegeDrop* drop, const char* name)
+{
+  int ngroups = 32;
+
+  while (1) {
+    int requested = ngroups;
+    REALLOC_N(drop->groups, gid_t, ngroups);
+    drop->groups_capacity = ngroups;
+    if (getgrouplist(name, drop->gid, drop->groups, &ngroups) >= 0)
+      break;
+    if (ngroups <= requested)
+      ngroups = requested * 2;
+  }
+  drop->ngroups = ngroups;
+}
+
+/*
+ * Compute a privilege drop.
+ *
+ * @overload initialize(uid:, gid: nil, groups: nil, keep: [], inheritable: [], bounding: keep, ambient: nil, lock: true)
+ *   @param uid [Integer, String] Target user.
+ *   @param gid [Integer] Target group. Defaults to the user's primary group.
+ *   @param groups [Array<Integer>, nil] Supplementary groups. Defaults to
+ *     the user's groups as initgroups(3) would set them.
+ *   @param keep [Array, Symbol, String, Integer, Hash] Capabilities kept in the
+ *     effective and permitted sets, or {mask: Integer}.
+ *   @param inheritable [Array, Symbol, String, Integer, Hash] The inheritable set.
+ *   @param bounding [Array, Symbol, String, Integer, Hash, nil] Capabilities kept
+ *     in the bounding set. Defaults to keep. nil leaves it alone.
+ *   @param ambient [Array, Symbol, String, Integer, Hash, nil] Capabilities raised
+ *     in the ambient set. They are added to the permitted and inheritable sets.
+ *   @param lock [Boolean] Lock the securebits like CapNG#lock.
+ *
+ * @return [nil]
+ *
+ */
+static VALUE
+rb_capng_privilege_drop_initialize(int argc, VALUE* argv, VALUE self)
+{
+  static ID keyword_ids[8];
+  VALUE rb_options, kwargs[8];
+  struct CapNGPrivilegeDrop* drop = capng_privilege_drop(self);
+  char name[256] = "";
+  int found = 0;
+  uint64_t keep = 0;
+
+  if (!keyword_ids[0]) {
+    keyword_ids[0] = rb_intern("uid");
+    keyword_ids[1] = rb_intern("gid");
+    keyword_ids[2] = rb_intern("groups");
+    keyword_ids[3] = rb_intern("keep");
+    keyword_ids[4] = rb_intern("inheritable");
+    keyword_ids[5] = rb_intern("bounding");
+    keyword_ids[6] = rb_intern("ambient");
+    keyword_ids[7] = rb_intern("lock");
+  }
+
+  rb_scan_args(argc, argv, ":", &rb_options);
+  rb_get_kwargs(rb_options, keyword_ids, 1, 7, kwargs);
+
+  found = capng_lookup_user(kwargs[0], &drop->uid, &drop->gid, name, sizeof(name)) == 0;
+  if (kwargs[1] != Qundef && !NIL_P(kwargs[1])) {
+    drop->gid = (gid_t)NUM2UINT(kwargs[1]);
+  } else if (!found) {
+    rb_raise(rb_eArgError, "gid is required for a uid without a passwd entry");
+  }
+
+  if (kwargs[2] != Qundef && !NIL_P(kwargs[2])) {
+    VALUE rb_groups = rb_Array(kwargs[2]);
+    drop->ngroups = (int)RARRAY_LEN(rb_groups);
+    REALLOC_N(drop->groups, gid_t, drop->ngroups > 0 ? drop->ngroups : 1);
+    drop->groups_capacity = drop->ngroups > 0 ? drop->ngroups : 1;
+    for (int i = 0; i < drop->ngroups; i++) {
+      drop->groups[i] = (gid_t)NUM2UINT(RARRAY_AREF(rb_groups, i));
+    }
+  } else if (found) {
+    capng_privilege_drop_init_groups(drop, name);
+  } else {
+    drop->ngroups = 1;
+    REALLOC_N(drop->groups, gid_t, 1);
+    drop->groups_capacity = 1;
+    drop->groups[0] = drop->gid;
+  }
+
+  if (kwargs[3] != Qundef && !NIL_P(kwargs[3]))
+    keep = value_to_requested_mask(kwargs[3]);
+  drop->caps.effective = keep;
+  drop->caps.permitted = keep;
+  if (kwargs[4] != Qundef && !NIL_P(kwargs[4]))
+    drop->caps.inheritable = value_to_requested_mask(kwargs[4]);
+
+  drop->flags = 0;
+  if (kwargs[5] == Qundef) {
+    drop->bounding = keep;
+    drop->flags |= DROP_BOUNDING;
+  } else if (!NIL_P(kwargs[5])) {
+    drop->bounding = value_to_requested_mask(kwargs[5]);
+    drop->flags |= DROP_BOUNDING;
+  }
+
+  if (kwargs[6] != Qundef && !NIL_P(kwargs[6])) {
+    drop->ambient = value_to_requested_mask(kwargs[6]);
+    drop->caps.permitted |= drop->ambient;
+    drop->caps.inheritable |= drop->ambient;
+    drop->flags |= DROP_AMBIENT;
+  }
+
+  if (kwargs[7] == Qundef || RTEST(kwargs[7]))
+    drop->flags |= DROP_LOCK;
+
+  return Qnil;
+}
+
+/* Only system calls from here on. The id changes go through libc so that
+ * they reach every thread, not just the calling one.
+ * Returns -1 on success, otherwise the failed step with errno set. */
+static int
+capng_privilege_drop_perform(const struct CapNGPrivilegeDrop* drop)
+{
+  if (drop->ngroups >= 0 && setgroups((size_t)drop->ngroups, drop->groups) != 0)
+    return DROP_STEP_SETGROUPS;
+  if (setresgid(drop->gid, drop->gid, drop->gid) != 0)
+    return DROP_STEP_SETRESGID;
+  if ((drop->flags & DROP_BOUNDING) && kernel_drop_bounding(drop->bounding) != 0)
+    return DROP_STEP_BOUNDING;
+  /* Either keeps the permitted set across the uid change. */
+  if (drop->flags & DROP_LOCK) {
+    if (kernel_lock_securebits() != 0)
+      return DROP_STEP_SECUREBITS;
+  } else if (kernel_set_keepcaps(1) != 0) {
+    return DROP_STEP_KEEPCAPS;
+  }
+  if (setresuid(drop->uid, drop->uid, drop->uid) != 0)
+    return DROP_STEP_SETRESUID;
+  if (kernel_capset(&drop->caps) != 0)
+    return DROP_STEP_CAPSET;
+  if ((drop->flags & DROP_AMBIENT) && kernel_set_ambient(drop->ambient) != 0)
+    return DROP_STEP_AMBIENT;
+  if (!(drop->flags & DROP_LOCK) && kernel_set_keepcaps(0) != 0)
+    return DROP_STEP_KEEPCAPS;
+
+  return -1;
+}
+
+/*
+ * Apply the privilege drop. The uid, gid and supplementary groups of every
+ * thread in the process change; the capabilities are set on the calling
+ * thread. Meant for a child right after fork.
+ *
+ * @raise [RuntimeError] A step failed. The message names it.
+ *
+ * @return [true]
+ *
+ */
+static VALUE
+rb_capng_privilege_drop_apply(VALUE self)
+{
+  struct CapNGPrivilegeDrop* drop = capng_privilege_drop(self);
+  int step = capng_privilege_drop_perform(drop);
+  int error = errno;
+
+  TRACE_RECORD(TRACE_PRIVILEGE_DROP,
+               (int)drop->uid,
+               (int)drop->gid,
+               step,
+               drop->caps.permitted,
+               drop->ambient,
+               step < 0 ? 0 : -1,
+               step < 0 ? 0 : error);
+
+  invalidate_current_capability_sets();
+  invalidate_applied_capabilities();
+
+  if (step >= 0) {
+    rb_raise(rb_eRuntimeError,
+             "Couldn't drop privileges at %s: %s",
+             drop_step_names[step],
+             strerror(error));
+  }
+
+  return Qtrue;
+}
+
+/*
+ * @return [Integer] The target uid.
+ */
+static VALUE
+rb_capng_privilege_drop_uid(VALUE self)
+{
+  return UINT2NUM(capng_privilege_drop(self)->uid);
+}
+
+/*
+ * @return [Integer] The target gid.
+ */
+static VALUE
+rb_capng_privilege_drop_gid(VALUE self)
+{
+  return UINT2NUM(capng_privilege_drop(self)->gid);
+}
+
+/*
+ * @return [Array<Integer>, nil] The supplementary groups to set.
+ */
+static VALUE
+rb_capng_privilege_drop_groups(VALUE self)
+{
+  struct CapNGPrivilegeDrop* drop = capng_privilege_drop(self);
+  VALUE rb_groups;
+
+  if (drop->ngroups < 0)
+    return Qnil;
+
+  rb_groups = rb_ary_new_capa(drop->ngroups);
+  for (int i = 0; i < drop->ngroups; i++) {
+    rb_ary_push(rb_groups, UINT2NUM(drop->groups[i]));
+  }
+
+  return rb_groups;
+}
+
+void
+Init_capng_privilege_drop(VALUE rb_cCapNG)
+{
+  VALUE rb_cPrivilegeDrop = rb_define_class_under(rb_cCapNG, "PrivilegeDrop", rb_cObject);
+
+  rb_define_alloc_func(rb_cPrivilegeDrop, rb_capng_privilege_drop_alloc);
+
+  rb_define_method(rb_cPrivilegeDrop, "initialize", rb_capng_privilege_drop_initialize, -1);
+  rb_define_method(rb_cPrivilegeDrop, "apply", rb_capng_privilege_drop_apply, 0);
+  rb_define_method(rb_cPrivilegeDrop, "uid", rb_capng_privilege_drop_uid, 0);
+  rb_define_method(rb_cPrivilegeDrop, "gid", rb_capng_privilege_drop_gid, 0);
+  rb_define_method(rb_cPrivilegeDrop, "groups", rb_capng_privilege_drop_groups, 0);
+}
@@ -0,0 +1,220 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+/* Parser for /proc/<pid>/status. It reads the file in chunks into a
+ * caller supplied buffer and never allocates, so it can also be run
+ * without the GVL. Lines longer than the buffer (e.g. a huge Groups:
+ * line) are skipped. */
+
+#include <capng.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <unistd.h>
+
+static uint64_t
+capng_proc_parse_hex(const char* p, const char* end)
+{
+  uint64_t value = 0;
+
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+  for (; p < end; p++) {
+    char c = *p;
+    if (c >= '0' && c <= '9')
+      value = (value << 4) | (uint64_t)(c - '0');
+    else if (c >= 'a' && c <= 'f')
+      value = (value << 4) | (uint64_t)(c - 'a' + 10);
+    else if (c >= 'A' && c <= 'F')
+      value = (value << 4) | (uint64_t)(c - 'A' + 10);
+    else
+      break;
+  }
+
+  return value;
+}
+
+static long
+capng_proc_parse_long(const char* p, const char* end)
+{
+  long value = 0;
+
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+  for (; p < end && *p >= '0' && *p <= '9'; p++)
+    value = value * 10 + (*p - '0');
+
+  return value;
+}
+
+#define PROC_STATUS_FIELD(line, len, name)                                               \
+  ((len) > sizeof(name) - 1 && memcmp((line), (name), sizeof(name) - 1) == 0)
+
+static void
+capng_proc_parse_line(const char* line, size_t len, ProcStatus* status)
+{
+  const char* end = line + len;
+
+  if (PROC_STATUS_FIELD(line, len, "Name:")) {
+    const char* p = line + 5;
+    size_t name_len = 0;
+    while (p < end && (*p == ' ' || *p == '\t'))
+      p++;
+    name_len = (size_t)(end - p);
+    if (name_len >= sizeof(status->name))
+      name_len = sizeof(status->name) - 1;
+    memcpy(status->name, p, name_len);
+    status->name[name_len] = '\0';
+  } else if (PROC_STATUS_FIELD(line, len, "Tgid:")) {
+    status->tgid = (int)capng_proc_parse_long(line + 5, end);
+  } else if (PROC_STATUS_FIELD(line, len, "Pid:")) {
+    status->pid = (int)capng_proc_parse_long(line + 4, end);
+  } else if (PROC_STATUS_FIELD(line, len, "PPid:")) {
+    status->ppid = (int)capng_proc_parse_long(line + 5, end);
+  } else if (PROC_STATUS_FIELD(line, len, "Uid:")) {
+    status->uid = capng_proc_parse_long(line + 4, end);
+  } else if (PROC_STATUS_FIELD(line, len, "Gid:")) {
+    status->gid = capng_proc_parse_long(line + 4, end);
+  } else if (PROC_STATUS_FIELD(line, len, "CapInh:")) {
+    status->sets.inheritable = capng_proc_parse_hex(line + 7, end);
+    status->found |= PROC_STATUS_INHERITABLE;
+  } else if (PROC_STATUS_FIELD(line, len, "CapPrm:")) {
+    status->sets.permitted = capng_proc_parse_hex(line + 7, end);
+    status->found |= PROC_STATUS_PERMITTED;
+  } else if (PROC_STATUS_FIELD(line, len, "CapEff:")) {
+    status->sets.effective = capng_proc_parse_hex(line + 7, end);
+    status->found |= PROC_STATUS_EFFECTIVE;
+  } else if (PROC_STATUS_FIELD(line, len, "CapBnd:")) {
+    status->sets.bounding = capng_proc_parse_hex(line + 7, end);
+    status->found |= PROC_STATUS_BOUNDING;
+  } else if (PROC_STATUS_FIELD(line, len, "CapAmb:")) {
+    status->sets.ambient = capng_proc_parse_hex(line + 7, end);
+    status->found |= PROC_STATUS_AMBIENT;
+  }
+}
+
+int
+read_proc_status_fd(int fd, ProcStatus* status, char* buffer, size_t size)
+{
+  size_t used = 0;
+  int skipping = 0;
+
+  memset(status, 0, sizeof(*status));
+
+  for (;;) {
+    ssize_t n = read(fd, buffer + used, size - used);
+    char* line = buffer;
+    char* end = NULL;
+    char* newline = NULL;
+
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (n == 0)
+      break;
+
+    end = buffer + used + n;
+    while ((newline = memchr(line, '\n', (size_t)(end - line))) != NULL) {
+      if (!skipping)
+        capng_proc_parse_line(line, (size_t)(newline - line), status);
+      skipping = 0;
+      line = newline + 1;
+    }
+
+    used = (size_t)(end - line);
+    if (used == size) {
+      /* The line doesn't fit into the buffer; drop it up to its end. */
+      skipping = 1;
+      used = 0;
+    } else if (used > 0) {
+      memmove(buffer, line, used);
+    }
+  }
+
+  if (used > 0 && !skipping)
+    capng_proc_parse_line(buffer, used, status);
+
+  return 0;
+}
+
+int
+read_proc_status(const char* path, ProcStatus* status, char* buffer, size_t size)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  int result = 0;
+  int saved_errno = 0;
+
+  if (fd < 0)
+    return -1;
+
+  result = read_proc_status_fd(fd, status, buffer, size);
+  saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+
+  return result;
+}
+
+int
+read_thread_bounding_ambient(uint64_t* bounding, uint64_t* ambient)
+{
+  char buffer[PROC_STATUS_BUFFER_SIZE];
+  char path[64];
+  ProcStatus status;
+  unsigned int capability = 0;
+
+  if (read_proc_status("/proc/thread-self/status", &status, buffer, sizeof(buffer)) ==
+        0 &&
+      (status.found & PROC_STATUS_BOUNDING)) {
+    *bounding = status.sets.bounding;
+    *ambient = status.sets.ambient;
+    return 0;
+  }
+
+  /* Kernels older than 3.17 don't have /proc/thread-self. */
+  snprintf(path, sizeof(path), "/proc/self/task/%d/status", kernel_gettid());
+  if (read_proc_status(path, &status, buffer, sizeof(buffer)) == 0 &&
+      (status.found & PROC_STATUS_BOUNDING)) {
+    *bounding = status.sets.bounding;
+    *ambient = status.sets.ambient;
+    return 0;
+  }
+
+  /* Without /proc, probe every capability until the kernel rejects it. */
+  *bounding = 0;
+  *ambient = 0;
+  for (capability = 0; capability <= CAPNG_C_LAST_CAP; capability++) {
+    int result = prctl(PR_CAPBSET_READ, capability, 0, 0, 0);
+    if (result < 0)
+      break;
+    if (result == 1)
+      *bounding |= CAPNG_C_MASK(capability);
+  }
+  if (capability == 0)
+    return -1;
+
+#if defined(PR_CAP_AMBIENT)
+  for (capability = 0; capability <= CAPNG_C_LAST_CAP; capability++) {
+    int result = prctl(PR_CAP_AMBIENT, PR_CAP_AMBIENT_IS_SET, capability, 0, 0);
+    if (result < 0)
+      break;
+    if (result == 1)
+      *ambient |= CAPNG_C_MASK(capability);
+  }
+#endif
+
+  return 0;
+}
@@ -0,0 +1,134 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+/* libcap-ng keeps its working state in thread local storage. Threads of
+ * the main Ractor own a native thread each, so they keep using it
+ * directly. Threads of other Ractors can hop between native threads
+ * whenever they block, so each of those Ractors carries its own copy of
+ * the state, which is swapped into the current native thread by
+ * ractor_state_enter() and saved back by ractor_state_leave(). */
+
+#include <capng.h>
+
+#if defined(HAVE_RB_RACTOR_LOCAL_STORAGE_PTR_NEWKEY)
+#include <ruby/ractor.h>
+
+struct CapNGRactorState
+{
+  int main;
+  int pid;
+  void* saved;
+};
+
+static void
+capng_ractor_state_free(void* ptr)
+{
+  struct CapNGRactorState* state = (struct CapNGRactorState*)ptr;
+
+  if (state->saved)
+    free(state->saved);
+  ruby_xfree(state);
+}
+
+static const struct rb_ractor_local_storage_type capng_ractor_state_type = {
+  NULL,
+  capng_ractor_state_free,
+};
+
+static rb_ractor_local_key_t capng_ractor_state_key;
+
+static struct CapNGRactorState*
+capng_ractor_state(void)
+{
+  struct CapNGRactorState* state = rb_ractor_local_storage_ptr(capng_ractor_state_key);
+
+  if (!state) {
+    state = ZALLOC(struct CapNGRactorState);
+    rb_ractor_local_storage_ptr_set(capng_ractor_state_key, state);
+  }
+
+  return state;
+}
+
+void
+ractor_state_enter(void)
+{
+  struct CapNGRactorState* state = capng_ractor_state();
+  capng_select_t select = CAPNG_SELECT_BOTH;
+
+  if (state->main)
+    return;
+
+  if (state->saved) {
+    capng_restore_state(&state->saved);
+    /* Keep a copy so that a call interrupted by an exception still
+     * leaves the last consistent state behind. */
+    state->saved = capng_save_state();
+  } else {
+#if defined(HAVE_CONST_CAPNG_SELECT_AMBIENT)
+    select |= CAPNG_SELECT_AMBIENT;
+#endif
+    capng_clear(select);
+  }
+
+  /* The saved state remembers the native thread it was taken on. */
+  capng_setpid(state->pid ? state->pid : kernel_gettid());
+}
+
+void
+ractor_state_leave(void)
+{
+  struct CapNGRactorState* state = capng_ractor_state();
+
+  if (state->main)
+    return;
+
+  if (state->saved)
+    free(state->saved);
+  state->saved = capng_save_state();
+}
+
+void
+ractor_state_setpid(int pid)
+{
+  capng_ractor_state()->pid = pid;
+}
+
+void
+Init_capng_ractor(VALUE rb_cCapNG)
+{
+  capng_ractor_state_key = rb_ractor_local_storage_ptr_newkey(&capng_ractor_state_type);
+  /* The extension is always loaded by the main Ractor. */
+  capng_ractor_state()->main = 1;
+}
+#else
+void
+ractor_state_enter(void)
+{
+}
+
+void
+ractor_state_leave(void)
+{
+}
+
+void
+ractor_state_setpid(int pid)
+{
+}
+
+void
+Init_capng_ractor(VALUE rb_cCapNG)
+{
+}
+#endif
@@ -0,0 +1,594 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+/* Parallel capability scanner for processes grouped by PID namespace or
+ * cgroup.
+ *
+ * Member processes are collected first, then native worker threads read
+ * them without the GVL. Each process is pinned by a pidfd before its
+ * /proc entries are read, and a result is only kept when the pidfd still
+ * refers to a live process afterwards, so a recycled pid can never be
+ * reported with another process' capabilities. Kernels without
+ * pidfd_open(2) compare the start time in /proc/<pid>/stat instead.
+ *
+ * The workers only use memory the scan owns: Ruby strings may be moved by
+ * GC.compact in another thread while the GVL is released. */
+
+#include <capng.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <ruby/thread.h>
+#include <ruby/util.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SCAN_MAX_THREADS 64
+#define SCAN_MAX_CGROUP_DEPTH 64
+
+struct CapNGScanTask
+{
+  int pid;
+  /* Index into the roots followed by the cgroups, or -1 when the root is
+   * found by the PID namespace. */
+  long tag;
+};
+
+struct CapNGScanResult
+{
+  int ok;
+  long tag;
+  unsigned long pid_namespace;
+  ProcStatus status;
+  char cgroup[256];
+};
+
+struct CapNGScan
+{
+  /* The arguments; converted inside rb_ensure() so nothing leaks when a
+   * conversion raises. */
+  VALUE rb_pids;
+  VALUE rb_cgroups;
+  long nroots;
+  int* root_pids;
+  unsigned long* root_namespaces;
+  long ncgroups;
+  char** cgroups;
+  struct CapNGScanTask* tasks;
+  size_t ntasks;
+  size_t capacity;
+  struct CapNGScanResult* results;
+  size_t next;
+  int threads;
+  int cancelled;
+  int error;
+};
+
+static int
+capng_scan_add_task(struct CapNGScan* scan, int pid, long tag)
+{
+  if (scan->ntasks == scan->capacity) {
+    size_t capacity = scan->capacity ? scan->capacity * 2 : 256;
+    struct CapNGScanTask* tasks = realloc(scan->tasks, capacity * sizeof(*tasks));
+    if (!tasks)
+      return -1;
+    scan->tasks = tasks;
+    scan->capacity = capacity;
+  }
+
+  scan->tasks[scan->ntasks].pid = pid;
+  scan->tasks[scan->ntasks].tag = tag;
+  scan->ntasks++;
+
+  return 0;
+}
+
+static unsigned long
+capng_scan_pid_namespace(int pid)
+{
+  char path[64];
+  struct stat st;
+
+  snprintf(path, sizeof(path), "/proc/%d/ns/pid", pid);
+  if (stat(path, &st) != 0)
+    return 0;
+
+  return (unsigned long)st.st_ino;
+}
+
+static int
+capng_scan_read_procs(struct CapNGScan* scan, int fd, long tag)
+{
+  char buffer[4096];
+  int pid = 0, digits = 0;
+  ssize_t n = 0;
+
+  while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+    for (ssize_t i = 0; i < n; i++) {
+      if (buffer[i] >= '0' && buffer[i] <= '9') {
+        pid = pid * 10 + (buffer[i] - '0');
+        digits++;
+      } else {
+        if (digits && capng_scan_add_task(scan, pid, tag) != 0)
+          return -1;
+        pid = 0;
+        digits = 0;
+      }
+    }
+  }
+  if (digits && n == 0 && capng_scan_add_task(scan, pid, tag) != 0)
+    return -1;
+
+  return n < 0 ? -1 : 0;
+}
+
+/* On cgroup v2 only leaves hold processes, so interior groups such as
+ * kubepods.slice have an empty cgroup.procs. The whole subtree is walked
+ * instead. Groups removed meanwhile are skipped. */
+static int
+capng_scan_collect_cgroup_at(struct CapNGScan* scan, int dirfd, long tag, int depth)
+{
+  DIR* dir = NULL;
+  struct dirent* entry = NULL;
+  int fd = openat(dirfd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+  int result = 0;
+
+  if (fd < 0) {
+    /* Only the given group has to be a cgroup. */
+    if (depth > 0 && errno == ENOENT)
+      return 0;
+    return -1;
+  }
+  result = capng_scan_read_procs(scan, fd, tag);
+  close(fd);
+  if (result != 0 || depth >= SCAN_MAX_CGROUP_DEPTH)
+    return result;
+
+  fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0 || !(dir = fdopendir(fd))) {
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  while (result == 0 && (entry = readdir(dir)) != NULL) {
+    int child = -1;
+
+    if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)
+      continue;
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+
+    child = openat(dirfd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (child < 0) {
+      if (errno != ENOENT && errno != ENOTDIR && errno != ELOOP)
+        result = -1;
+      continue;
+    }
+    result = capng_scan_collect_cgroup_at(scan, child, tag, depth + 1);
+    close(child);
+  }
+  closedir(dir);
+
+  return result;
+}
+
+static int
+capng_scan_collect_cgroup(struct CapNGScan* scan, long index)
+{
+  int fd = open(scan->cgroups[index], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  int result = 0;
+  int saved_errno = 0;
+
+  if (fd < 0)
+    return -1;
+
+  result = capng_scan_collect_cgroup_at(scan, fd, scan->nroots + index, 0);
+  saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+
+  return result;
+}
+
+static int
+capng_scan_collect_proc(struct CapNGScan* scan)
+{
+  DIR* dir = opendir("/proc");
+  struct dirent* entry = NULL;
+
+  if (!dir)
+    return -1;
+
+  while ((entry = readdir(dir)) != NULL) {
+    char* end = NULL;
+    long pid = strtol(entry->d_name, &end, 10);
+    if (*end != '\0' || pid <= 0)
+      continue;
+    if (capng_scan_add_task(scan, (int)pid, -1) != 0) {
+      closedir(dir);
+      return -1;
+    }
+  }
+  closedir(dir);
+
+  return 0;
+}
+
+static void
+capng_scan_read_cgroup(int pid, char* cgroup, size_t size)
+{
+  char path[64];
+  char buffer[4096];
+  char* line = NULL;
+  char* newline = NULL;
+  char* found = NULL;
+  size_t len = 0;
+  ssize_t n = 0;
+  int fd = -1;
+
+  cgroup[0] = '\0';
+  snprintf(path, sizeof(path), "/proc/%d/cgroup", pid);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  n = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  if (n <= 0)
+    return;
+  buffer[n] = '\0';
+
+  /* Prefer the unified (cgroup v2) hierarchy, i.e. the "0::" line. */
+  for (line = buffer; *line; line = newline + 1) {
+    newline = strchr(line, '\n');
+    if (!newline)
+      newline = line + strlen(line);
+    if (!found)
+      found = line;
+    if (strncmp(line, "0::", 3) == 0) {
+      found = line;
+      break;
+    }
+    if (!*newline)
+      break;
+  }
+  if (!found)
+    return;
+
+  /* Drop "hierarchy-ID:controller-list:" */
+  line = strchr(found, ':');
+  line = line ? strchr(line + 1, ':') : NULL;
+  if (!line)
+    return;
+  line++;
+  newline = strchr(line, '\n');
+  len = newline ? (size_t)(newline - line) : strlen(line);
+  if (len >= size)
+    len = size - 1;
+  memcpy(cgroup, line, len);
+  cgroup[len] = '\0';
+}
+
+/* The start time of a process in clock ticks since boot, field 22 of
+ * /proc/<pid>/stat. Returns 0 when it can't be read. */
+static unsigned long long
+capng_scan_start_time(int pid)
+{
+  char path[64];
+  char buffer[1024];
+  char* field = NULL;
+  ssize_t n = 0;
+  int fd = -1;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  n = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  if (n <= 0)
+    return 0;
+  buffer[n] = '\0';
+
+  /* The command name may contain spaces and parentheses; the fields
+   * after it start with the state, field 3. */
+  field = strrchr(buffer, ')');
+  for (int i = 2; field && i < 22; i++) {
+    field = strchr(field + 1, ' ');
+  }
+
+  return field ? strtoull(field + 1, NULL, 10) : 0;
+}
+
+static void
+capng_scan_process(struct CapNGScan* scan, size_t index, char* buffer, size_t size)
+{
+  struct CapNGScanTask* task = &scan->tasks[index];
+  struct CapNGScanResult* result = &scan->results[index];
+  char path[64];
+  unsigned long long start_time = 0;
+  int pidfd = kernel_pidfd_open(task->pid);
+
+  if (pidfd < 0) {
+    if (errno != ENOSYS)
+      return;
+    /* Without pidfds a recycled pid shows up as a different start time. */
+    start_time = capng_scan_start_time(task->pid);
+    if (start_time == 0)
+      return;
+  }
+
+  result->tag = task->tag;
+  result->pid_namespace = capng_scan_pid_namespace(task->pid);
+  if (result->tag < 0) {
+    for (long i = 0; i < scan->nroots; i++) {
+      if (scan->root_namespaces[i] && scan->root_namespaces[i] == result->pid_namespace) {
+        result->tag = i;
+        break;
+      }
+    }
+    if (result->tag < 0)
+      goto done;
+  }
+
+  snprintf(path, sizeof(path), "/proc/%d/status", task->pid);
+  if (read_proc_status(path, &result->status, buffer, size) != 0 ||
+      !(result->status.found & PROC_STATUS_EFFECTIVE))
+    goto done;
+  capng_scan_read_cgroup(task->pid, result->cgroup, sizeof(result->cgroup));
+
+  if (pidfd >= 0 ? !kernel_pidfd_alive(pidfd)
+                 : capng_scan_start_time(task->pid) != start_time)
+    goto done;
+
+  result->ok = 1;
+
+done:
+  if (pidfd >= 0)
+    close(pidfd);
+}
+
+static void*
+capng_scan_worker(void* arg)
+{
+  struct CapNGScan* scan = (struct CapNGScan*)arg;
+  char buffer[PROC_STATUS_BUFFER_SIZE];
+
+  while (!__atomic_load_n(&scan->cancelled, __ATOMIC_RELAXED)) {
+    size_t index = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED);
+    if (index >= scan->ntasks)
+      break;
+    capng_scan_process(scan, index, buffer, sizeof(buffer));
+  }
+
+  return NULL;
+}
+
+static void*
+capng_scan_run(void* arg)
+{
+  struct CapNGScan* scan = (struct CapNGScan*)arg;
+  pthread_t threads[SCAN_MAX_THREADS];
+  int started = 0;
+
+  for (long i = 0; i < scan->nroots; i++) {
+    scan->root_namespaces[i] = capng_scan_pid_namespace(scan->root_pids[i]);
+  }
+  for (long i = 0; i < scan->ncgroups; i++) {
+    if (capng_scan_collect_cgroup(scan, i) != 0) {
+      scan->error = errno;
+      return NULL;
+    }
+  }
+  if (scan->nroots > 0 && capng_scan_collect_proc(scan) != 0) {
+    scan->error = errno;
+    return NULL;
+  }
+  if (scan->ntasks == 0)
+    return NULL;
+
+  scan->results = calloc(scan->ntasks, sizeof(*scan->results));
+  if (!scan->results) {
+    scan->error = ENOMEM;
+    return NULL;
+  }
+
+  for (int i = 1; i < scan->threads && (size_t)i < scan->ntasks; i++) {
+    if (pthread_create(&threads[started], NULL, capng_scan_worker, scan) != 0)
+      break;
+    started++;
+  }
+  capng_scan_worker(scan);
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  return NULL;
+}
+
+static void
+capng_scan_cancel(void* arg)
+{
+  struct CapNGScan* scan = (struct CapNGScan*)arg;
+
+  __atomic_store_n(&scan->cancelled, 1, __ATOMIC_RELAXED);
+}
+
+static VALUE
+capng_scan_release(VALUE arg)
+{
+  struct CapNGScan* scan = (struct CapNGScan*)arg;
+
+  free(scan->tasks);
+  free(scan->results);
+  xfree(scan->root_pids);
+  xfree(scan->root_namespaces);
+  for (long i = 0; i < scan->ncgroups; i++) {
+    xfree(scan->cgroups[i]);
+  }
+  xfree(scan->cgroups);
+
+  return Qnil;
+}
+
+static VALUE
+capng_scan_perform(VALUE arg)
+{
+  struct CapNGScan* scan = (struct CapNGScan*)arg;
+  VALUE rb_results = Qnil;
+  VALUE rb_roots = Qnil;
+
+  if (!NIL_P(scan->rb_pids)) {
+    scan->root_pids = ALLOC_N(int, RARRAY_LEN(scan->rb_pids));
+    scan->root_namespaces = ZALLOC_N(unsigned long, RARRAY_LEN(scan->rb_pids));
+    for (long i = 0; i < RARRAY_LEN(scan->rb_pids); i++) {
+      scan->root_pids[i] = NUM2INT(RARRAY_AREF(scan->rb_pids, i));
+      scan->nroots++;
+    }
+  }
+  if (!NIL_P(scan->rb_cgroups)) {
+    scan->cgroups = ALLOC_N(char*, RARRAY_LEN(scan->rb_cgroups));
+    for (long i = 0; i < RARRAY_LEN(scan->rb_cgroups); i++) {
+      VALUE rb_path = RARRAY_AREF(scan->rb_cgroups, i);
+      /* A copy: the workers read it without the GVL. */
+      scan->cgroups[i] = ruby_strdup(StringValueCStr(rb_path));
+      scan->ncgroups++;
+    }
+  }
+
+  rb_roots = rb_ary_new_capa(scan->nroots + scan->ncgroups);
+
+  for (long i = 0; i < scan->nroots; i++) {
+    rb_ary_push(rb_roots, INT2NUM(scan->root_pids[i]));
+  }
+  for (long i = 0; i < scan->ncgroups; i++) {
+    rb_ary_push(rb_roots, rb_str_new_cstr(scan->cgroups[i]));
+  }
+
+  rb_thread_call_without_gvl(capng_scan_run, scan, capng_scan_cancel, scan);
+  if (scan->cancelled)
+    rb_thread_check_ints();
+  if (scan->error) {
+    rb_syserr_fail(scan->error, "Couldn't collect processes to scan");
+  }
+
+  rb_results = rb_ary_new();
+  for (size_t i = 0; i < scan->ntasks && scan->results; i++) {
+    struct CapNGScanResult* result = &scan->results[i];
+    VALUE rb_result;
+
+    if (!result->ok)
+      continue;
+
+    rb_result = rb_hash_new();
+    rb_hash_aset(rb_result, ID2SYM(rb_intern("pid")), INT2NUM(scan->tasks[i].pid));
+    rb_hash_aset(rb_result, ID2SYM(rb_intern("name")), rb_str_new_cstr(result->status.name));
+    rb_hash_aset(rb_result, ID2SYM(rb_intern("uid")), LONG2NUM(result->status.uid));
+    rb_hash_aset(
+      rb_result, ID2SYM(rb_intern("pid_namespace")), ULONG2NUM(result->pid_namespace));
+    rb_hash_aset(rb_result, ID2SYM(rb_intern("cgroup")), rb_str_new_cstr(result->cgroup));
+    rb_hash_aset(rb_result, ID2SYM(rb_intern("root")), RARRAY_AREF(rb_roots, result->tag));
+    rb_hash_aset(
+      rb_result, ID2SYM(rb_intern("effective")), ULL2NUM(result->status.sets.effective));
+    rb_hash_aset(
+      rb_result, ID2SYM(rb_intern("permitted")), ULL2NUM(result->status.sets.permitted));
+    rb_hash_aset(rb_result,
+                 ID2SYM(rb_intern("inheritable")),
+                 ULL2NUM(result->status.sets.inheritable));
+    rb_hash_aset(
+      rb_result, ID2SYM(rb_intern("bounding")), ULL2NUM(result->status.sets.bounding));
+    rb_hash_aset(
+      rb_result, ID2SYM(rb_intern("ambient")), ULL2NUM(result->status.sets.ambient));
+    rb_ary_push(rb_results, rb_result);
+  }
+
+  return rb_results;
+}
+
+/*
+ * Scan capabilities of every process in the given PID namespaces and
+ * cgroups in parallel.
+ *
+ * @overload scan_processes(pids: [], cgroups: [], threads: nil)
+ *   @param pids [Array<Integer>] Processes whose PID namespace is scanned.
+ *   @param cgroups [Array<String>] cgroup directories whose members, including
+ *     the members of every descendant cgroup, are scanned.
+ *   @param threads [Integer] The number of native threads. Defaults to the
+ *     number of online CPUs.
+ *
+ * @example
+ *  CapNG.scan_processes(pids: [1], cgroups: ["/sys/fs/cgroup/kubepods.slice"])
+ *  #=> [{pid: 1, name: "systemd", uid: 0, pid_namespace: 4026531836,
+ *  #     cgroup: "/init.scope", root: 1, effective: 2199023255551, ...}, ...]
+ *
+ * @return [Array<Hash>] Per process results. :root is the given pid or
+ *   cgroup the process was found through, and the capability sets are masks.
+ *
+ */
+static VALUE
+rb_capng_s_scan_processes(int argc, VALUE* argv, VALUE self)
+{
+  static ID keyword_ids[3];
+  VALUE rb_options, kwargs[3];
+  VALUE rb_pids = Qnil, rb_cgroups = Qnil, rb_results = Qnil;
+  struct CapNGScan scan;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (!keyword_ids[0]) {
+    keyword_ids[0] = rb_intern("pids");
+    keyword_ids[1] = rb_intern("cgroups");
+    keyword_ids[2] = rb_intern("threads");
+  }
+
+  rb_scan_args(argc, argv, ":", &rb_options);
+  rb_get_kwargs(rb_options, keyword_ids, 0, 3, kwargs);
+
+  memset(&scan, 0, sizeof(scan));
+  scan.threads = cpus > 0 ? (int)cpus : 1;
+  if (kwargs[2] != Qundef && !NIL_P(kwargs[2]))
+    scan.threads = NUM2INT(kwargs[2]);
+  if (scan.threads < 1)
+    scan.threads = 1;
+  if (scan.threads > SCAN_MAX_THREADS)
+    scan.threads = SCAN_MAX_THREADS;
+
+  if (kwargs[0] != Qundef && !NIL_P(kwargs[0]))
+    rb_pids = rb_ary_dup(rb_Array(kwargs[0]));
+  if (kwargs[1] != Qundef && !NIL_P(kwargs[1]))
+    rb_cgroups = rb_Array(kwargs[1]);
+  if (!NIL_P(rb_cgroups)) {
+    VALUE rb_paths = rb_ary_new_capa(RARRAY_LEN(rb_cgroups));
+    for (long i = 0; i < RARRAY_LEN(rb_cgroups); i++) {
+      VALUE rb_path = RARRAY_AREF(rb_cgroups, i);
+      FilePathValue(rb_path);
+      rb_ary_push(rb_paths, rb_str_new_frozen(rb_path));
+    }
+    rb_cgroups = rb_paths;
+  }
+
+  scan.rb_pids = rb_pids;
+  scan.rb_cgroups = rb_cgroups;
+  rb_results = rb_ensure(capng_scan_perform, (VALUE)&scan, capng_scan_release, (VALUE)&scan);
+  RB_GC_GUARD(rb_pids);
+  RB_GC_GUARD(rb_cgroups);
+
+  return rb_results;
+}
+
+void
+Init_capng_scan(VALUE rb_cCapNG)
+{
+  rb_define_singleton_method(rb_cCapNG, "scan_processes", rb_capng_s_scan_processes, -1);
+}
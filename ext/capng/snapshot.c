@@ -0,0 +1,117 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+/* Memoized capability sets of the calling thread.
+ *
+ * Capabilities are per thread, so each native thread keeps its own
+ * snapshot. They are tagged with a process wide generation which is
+ * bumped whenever this extension may have changed capabilities (apply,
+ * change_id, lock, clear/fill and State#restore) or on CapNG.refresh!.
+ * A snapshot of an older generation is read again on next use. */
+
+#include <capng.h>
+
+struct CapNGSnapshot
+{
+  int caps_valid;
+  int bounding_ambient_valid;
+  unsigned long generation;
+  CapabilitySets sets;
+};
+
+static unsigned long snapshot_generation = 1;
+static __thread struct CapNGSnapshot snapshot;
+
+/*
+ * Obtain the calling thread's capability sets. Effective, permitted and
+ * inheritable sets come from capget(2); bounding and ambient sets are
+ * read from /proc only when requested.
+ */
+const CapabilitySets*
+current_capability_sets(int with_bounding_ambient)
+{
+  unsigned long generation = __atomic_load_n(&snapshot_generation, __ATOMIC_ACQUIRE);
+  KernelCapabilities caps;
+
+  if (snapshot.generation != generation) {
+    snapshot.caps_valid = 0;
+    snapshot.bounding_ambient_valid = 0;
+    snapshot.generation = generation;
+  }
+
+  if (!snapshot.caps_valid) {
+    if (kernel_capget(0, &caps) != 0) {
+      rb_raise(rb_eRuntimeError, "Couldn't get current process' capability");
+    }
+    snapshot.sets.effective = caps.effective;
+    snapshot.sets.permitted = caps.permitted;
+    snapshot.sets.inheritable = caps.inheritable;
+    snapshot.caps_valid = 1;
+  }
+
+  if (with_bounding_ambient && !snapshot.bounding_ambient_valid) {
+    if (read_thread_bounding_ambient(&snapshot.sets.bounding, &snapshot.sets.ambient) !=
+        0) {
+      rb_raise(rb_eRuntimeError, "Couldn't get current process' capability");
+    }
+    snapshot.bounding_ambient_valid = 1;
+  }
+
+  return &snapshot.sets;
+}
+
+void
+invalidate_current_capability_sets(void)
+{
+  __atomic_add_fetch(&snapshot_generation, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Drop every memoized current process capability set, so that the next
+ * query reads them from the kernel again. The capability sets applied
+ * last time are forgotten as well.
+ *
+ * Call this after changing capabilities without CapNG, e.g. with
+ * Process::Sys.setuid.
+ *
+ * @return [Integer] The new generation.
+ *
+ */
+static VALUE
+rb_capng_s_refresh_bang(VALUE self)
+{
+  invalidate_applied_capabilities();
+  invalidate_current_capability_sets();
+
+  return ULONG2NUM(__atomic_load_n(&snapshot_generation, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Obtain the current generation of memoized capability sets.
+ *
+ * @return [Integer]
+ *
+ */
+static VALUE
+rb_capng_s_snapshot_generation(VALUE self)
+{
+  return ULONG2NUM(__atomic_load_n(&snapshot_generation, __ATOMIC_ACQUIRE));
+}
+
+void
+Init_capng_snapshot(VALUE rb_cCapNG)
+{
+  rb_define_singleton_method(rb_cCapNG, "refresh!", rb_capng_s_refresh_bang, 0);
+  rb_define_singleton_method(
+    rb_cCapNG, "snapshot_generation", rb_capng_s_snapshot_generation, 0);
+}
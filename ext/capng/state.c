@@ -29,23 +29,32 @@
 
 #include <capng.h>
 
+#if defined(HAVE_MALLOC_USABLE_SIZE)
+#include <malloc.h>
+#endif
+
 struct CapNGState
 {
   void* state;
+  int embedded;
 };
 
 static void
 capng_state_free(void* capng);
-
-static const rb_data_type_t rb_capng_state_type = { "capng/state",
-                                                    {
-                                                      0,
-                                                      capng_state_free,
-                                                      0,
-                                                    },
-                                                    NULL,
-                                                    NULL,
-                                                    RUBY_TYPED_FREE_IMMEDIATELY };
+static size_t
+capng_state_memsize(const void* capng);
+
+static const rb_data_type_t rb_capng_state_type = {
+  "capng/state",
+  {
+    0,
+    capng_state_free,
+    capng_state_memsize,
+  },
+  NULL,
+  NULL,
+  RUBY_TYPED_FREE_IMMEDIATELY | CAPNG_TYPED_EMBEDDABLE
+};
 
 static void
 capng_state_free(void* ptr)
@@ -62,7 +71,26 @@ capng_state_free(void* ptr)
     }
   }
 
-  xfree(ptr);
+  /* An embedded struct lives in the object slot and goes with it, and Ruby
+   * xfree()s a non-embedded struct of an embeddable type after this returns.
+   * Only a type without the flag leaves releasing the struct to us. */
+  if (!(rb_capng_state_type.flags & CAPNG_TYPED_EMBEDDABLE))
+    xfree(ptr);
+}
+
+static size_t
+capng_state_memsize(const void* ptr)
+{
+  const struct CapNGState* state = (const struct CapNGState*)ptr;
+  size_t size = state->embedded ? 0 : sizeof(struct CapNGState);
+
+#if defined(HAVE_MALLOC_USABLE_SIZE)
+  /* The blob from capng_save_state() is an opaque malloc(3) block. */
+  if (state->state)
+    size += malloc_usable_size(state->state);
+#endif
+
+  return size;
 }
 
 static VALUE
@@ -72,6 +100,8 @@ rb_capng_state_alloc(VALUE klass)
   struct CapNGState* capng_state;
   obj =
     TypedData_Make_Struct(klass, struct CapNGState, &rb_capng_state_type, capng_state);
+  /* Whether the struct fit the slot is decided per object, not per build. */
+  capng_state->embedded = CAPNG_TYPED_EMBEDDED_P(obj);
   return obj;
 }
 
@@ -111,7 +141,9 @@ rb_capng_state_save(VALUE self)
     capng_state->state = NULL;
   }
 
+  ractor_state_enter();
   capng_state->state = capng_save_state();
+  ractor_state_leave();
 
   return Qnil;
 }
@@ -135,7 +167,18 @@ rb_capng_state_restore(VALUE self)
    * left capng_state->state dangling, causing a use-after-free / double-free on
    * a second #restore. With the field NULLed, a repeated #restore is a safe
    * no-op because libcap-ng ignores a NULL saved state. */
+  ractor_state_enter();
   capng_restore_state(&capng_state->state);
+  TRACE_RECORD(TRACE_STATE_RESTORE,
+               0,
+               0,
+               0,
+               capability_mask(CAPNG_EFFECTIVE),
+               capability_mask(CAPNG_PERMITTED),
+               0,
+               0);
+  ractor_state_leave();
+  invalidate_current_capability_sets();
 
   return Qnil;
 }
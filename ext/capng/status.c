@@ -0,0 +1,174 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+
+/* Non-raising variants of the file and process queries.
+ *
+ * They report the outcome as a Symbol instead of true/false or an
+ * exception, so that scanners can tell "no file capabilities" apart from
+ * permission or lookup errors without building exception objects. The
+ * Symbols are static, so the calls allocate nothing. */
+
+#include <capng.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+static ID id_ok;
+static ID id_no_caps;
+static ID id_eacces;
+static ID id_enoent;
+static ID id_eperm;
+static ID id_esrch;
+static ID id_enotsup;
+static ID id_ebadf;
+static ID id_einval;
+static ID id_timeout;
+static ID id_error;
+
+VALUE
+capng_status_from_errno(int error)
+{
+  switch (error) {
+    case 0:
+      return ID2SYM(id_ok);
+    case ENODATA:
+      return ID2SYM(id_no_caps);
+    case EACCES:
+      return ID2SYM(id_eacces);
+    case ENOENT:
+    case ENOTDIR:
+      return ID2SYM(id_enoent);
+    case EPERM:
+      return ID2SYM(id_eperm);
+    case ESRCH:
+      return ID2SYM(id_esrch);
+    case EOPNOTSUPP:
+      return ID2SYM(id_enotsup);
+    case EBADF:
+      return ID2SYM(id_ebadf);
+    case EINVAL:
+      return ID2SYM(id_einval);
+    case ETIMEDOUT:
+      return ID2SYM(id_timeout);
+    default:
+      return ID2SYM(id_error);
+  }
+}
+
+/* capng_get_caps_fd() fails without errno for e.g. non-regular files. */
+static int
+capng_status_get_caps_fd(int fd)
+{
+  int result = 0;
+
+  errno = 0;
+  ractor_state_enter();
+  result = capng_get_caps_fd(fd);
+  ractor_state_leave();
+  if (result == 0)
+    return 0;
+
+  return errno ? errno : EINVAL;
+}
+
+/*
+ * Retrieve capabilities from a file like #caps_file, but report the
+ * outcome instead of raising or returning false.
+ *
+ * @param rb_file_or_path [File or String] A File or the path to open.
+ *
+ * @return [Symbol] :ok, :no_caps, :eacces, :enoent, :eperm, :enotsup,
+ *   :ebadf, :einval or :error.
+ *
+ */
+static VALUE
+rb_capng_caps_file_status(VALUE self, VALUE rb_file_or_path)
+{
+  int fd = -1, error = 0;
+
+  if (RB_TYPE_P(rb_file_or_path, T_FILE)) {
+    return capng_status_from_errno(
+      capng_status_get_caps_fd(capng_get_file_descriptor(rb_file_or_path)));
+  }
+
+  FilePathValue(rb_file_or_path);
+  if (memchr(RSTRING_PTR(rb_file_or_path), '\0', RSTRING_LEN(rb_file_or_path)))
+    return ID2SYM(id_einval);
+
+  fd = open(StringValueCStr(rb_file_or_path), O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0)
+    return capng_status_from_errno(errno);
+  error = capng_status_get_caps_fd(fd);
+  close(fd);
+
+  return capng_status_from_errno(error);
+}
+
+/*
+ * Retrieve capabilities of a process like #caps_process, but report the
+ * outcome instead of returning false.
+ *
+ * @overload caps_process_status(pid = nil)
+ *   @param pid [Integer] Target process. The target set by #setpid is used
+ *     when omitted.
+ *
+ * @return [Symbol] :ok, :esrch, :eacces, :enoent, :eperm or :error.
+ *
+ */
+static VALUE
+rb_capng_caps_process_status(int argc, VALUE* argv, VALUE self)
+{
+  VALUE rb_pid = Qnil;
+  int result = 0, error = 0;
+
+  rb_scan_args(argc, argv, "01", &rb_pid);
+
+  ractor_state_enter();
+  if (!NIL_P(rb_pid)) {
+    capng_setpid(NUM2INT(rb_pid));
+    ractor_state_setpid(NUM2INT(rb_pid));
+  }
+  errno = 0;
+  result = capng_get_caps_process();
+  error = errno;
+  ractor_state_leave();
+
+  if (result == 0)
+    return ID2SYM(id_ok);
+
+  return capng_status_from_errno(error ? error : ESRCH);
+}
+
+void
+Init_capng_status(VALUE rb_cCapNG)
+{
+  id_ok = rb_intern("ok");
+  id_no_caps = rb_intern("no_caps");
+  id_eacces = rb_intern("eacces");
+  id_enoent = rb_intern("enoent");
+  id_eperm = rb_intern("eperm");
+  id_esrch = rb_intern("esrch");
+  id_enotsup = rb_intern("enotsup");
+  id_ebadf = rb_intern("ebadf");
+  id_einval = rb_intern("einval");
+  id_timeout = rb_intern("timeout");
+  id_error = rb_intern("error");
+
+  rb_define_method(rb_cCapNG, "caps_file_status", rb_capng_caps_file_status, 1);
+  rb_define_method(rb_cCapNG, "caps_process_status", rb_capng_caps_process_status, -1);
+  rb_define_singleton_method(rb_cCapNG, "caps_file_status", rb_capng_caps_file_status, 1);
+  rb_define_singleton_method(
+    rb_cCapNG, "caps_process_status", rb_capng_caps_process_status, -1);
+}
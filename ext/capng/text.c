@@ -0,0 +1,198 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+
+/* Parser for libcap's textual capability representation, as used by
+ * setcap(8) and cap_from_text(3), e.g. "cap_net_raw,cap_net_bind_service+eip".
+ *
+ * The text is a whitespace separated list of clauses. Each clause is a
+ * comma separated capability list followed by one or more operator and
+ * flag groups: "=" replaces, "+" raises and "-" lowers the listed
+ * capabilities in the effective (e), inheritable (i) and permitted (p)
+ * sets. An empty list before "=" and the name "all" stand for every
+ * capability. Names may carry the "cap_" prefix and are matched without
+ * regard to case. */
+
+#include <capng.h>
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+#define TEXT_FLAG_EFFECTIVE 0x01
+#define TEXT_FLAG_INHERITABLE 0x02
+#define TEXT_FLAG_PERMITTED 0x04
+
+static uint64_t
+capability_text_all(void)
+{
+  uint64_t mask = 0;
+
+  for (int i = 0; capabilityInfoTable[i].name != NULL; i++) {
+    if (capabilityInfoTable[i].code <= CAPNG_C_LAST_CAP)
+      mask |= CAPNG_C_MASK(capabilityInfoTable[i].code);
+  }
+
+  return mask;
+}
+
+static int
+capability_text_name(const char* name, size_t len, uint64_t* mask)
+{
+  if (len > 4 && strncasecmp(name, "cap_", 4) == 0) {
+    name += 4;
+    len -= 4;
+  }
+  if (len == 0)
+    return -1;
+
+  if (len == 3 && strncasecmp(name, "all", 3) == 0) {
+    *mask |= capability_text_all();
+    return 0;
+  }
+
+  if (isdigit((unsigned char)name[0])) {
+    unsigned int code = 0;
+    for (size_t i = 0; i < len; i++) {
+      if (!isdigit((unsigned char)name[i]) || code > CAPNG_C_LAST_CAP)
+        return -1;
+      code = code * 10 + (unsigned int)(name[i] - '0');
+    }
+    if (code > CAPNG_C_LAST_CAP)
+      return -1;
+    *mask |= CAPNG_C_MASK(code);
+    return 0;
+  }
+
+  for (int i = 0; capabilityInfoTable[i].name != NULL; i++) {
+    if (strlen(capabilityInfoTable[i].name) == len &&
+        strncasecmp(capabilityInfoTable[i].name, name, len) == 0) {
+      if (capabilityInfoTable[i].code > CAPNG_C_LAST_CAP)
+        return -1;
+      *mask |= CAPNG_C_MASK(capabilityInfoTable[i].code);
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+static void
+capability_text_update(CapabilitySets* sets, char op, int flags, uint64_t mask)
+{
+  uint64_t* targets[3] = { &sets->effective, &sets->inheritable, &sets->permitted };
+
+  for (int i = 0; i < 3; i++) {
+    int selected = flags & (1 << i);
+    if (op == '=')
+      *targets[i] = selected ? (*targets[i] | mask) : (*targets[i] & ~mask);
+    else if (op == '+' && selected)
+      *targets[i] |= mask;
+    else if (op == '-' && selected)
+      *targets[i] &= ~mask;
+  }
+}
+
+/* strchr() would match the terminating NUL, and the text may hold NULs. */
+static int
+capability_text_operator_p(char c)
+{
+  return c == '=' || c == '+' || c == '-';
+}
+
+/* Returns 0 on success. On failure returns -1 and sets *error_offset to
+ * the byte offset of the offending clause element and *error to a
+ * description. Only effective, permitted and inheritable are set. */
+int
+parse_capability_text(const char* text,
+                      size_t len,
+                      CapabilitySets* sets,
+                      size_t* error_offset,
+                      const char** error)
+{
+  size_t p = 0;
+
+  memset(sets, 0, sizeof(*sets));
+
+  while (1) {
+    uint64_t mask = 0;
+    size_t list = 0;
+
+    while (p < len && isspace((unsigned char)text[p]))
+      p++;
+    if (p >= len)
+      break;
+
+    /* Capability list */
+    list = p;
+    while (p < len && !capability_text_operator_p(text[p]) &&
+           !isspace((unsigned char)text[p]))
+      p++;
+    if (p >= len || isspace((unsigned char)text[p])) {
+      *error_offset = list;
+      *error = "missing operator";
+      return -1;
+    }
+    if (p == list) {
+      if (text[p] != '=') {
+        *error_offset = p;
+        *error = "missing capability list";
+        return -1;
+      }
+      mask = capability_text_all();
+    } else {
+      size_t name = list;
+      for (size_t i = list; i <= p; i++) {
+        if (i < p && text[i] != ',')
+          continue;
+        if (capability_text_name(text + name, i - name, &mask) != 0) {
+          *error_offset = name;
+          *error = "unknown capability";
+          return -1;
+        }
+        name = i + 1;
+      }
+    }
+
+    /* Operators and flags */
+    while (p < len && capability_text_operator_p(text[p])) {
+      char op = text[p++];
+      int flags = 0;
+
+      for (; p < len; p++) {
+        if (text[p] == 'e')
+          flags |= TEXT_FLAG_EFFECTIVE;
+        else if (text[p] == 'i')
+          flags |= TEXT_FLAG_INHERITABLE;
+        else if (text[p] == 'p')
+          flags |= TEXT_FLAG_PERMITTED;
+        else
+          break;
+      }
+      if (op != '=' && !flags) {
+        *error_offset = p;
+        *error = "missing flags";
+        return -1;
+      }
+      capability_text_update(sets, op, flags, mask);
+    }
+
+    if (p < len && !isspace((unsigned char)text[p])) {
+      *error_offset = p;
+      *error = "unexpected character";
+      return -1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,182 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+
+/* Per-thread capability inspection.
+ *
+ * Capabilities belong to threads, so /proc/<pid>/status only tells about
+ * the thread-group leader. The task directory is read with getdents64(2)
+ * and every /proc/<pid>/task/<tid>/status is parsed through one shared
+ * buffer before any Ruby object is created. */
+
+#include <capng.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define THREADS_DIRENT_BATCH_SIZE 8192
+
+struct CapNGThreads
+{
+  int fd;
+  char* dirents;
+  ProcStatus* threads;
+  size_t nthreads;
+  size_t capacity;
+  char status_buffer[PROC_STATUS_BUFFER_SIZE];
+};
+
+static int
+capng_threads_same_sets(const CapabilitySets* a, const CapabilitySets* b)
+{
+  return a->effective == b->effective && a->permitted == b->permitted &&
+         a->inheritable == b->inheritable && a->bounding == b->bounding &&
+         a->ambient == b->ambient;
+}
+
+static VALUE
+capng_threads_perform(VALUE arg)
+{
+  struct CapNGThreads* scan = (struct CapNGThreads*)arg;
+  const ProcStatus* leader = NULL;
+  VALUE rb_threads;
+  char path[64];
+  long n = 0;
+
+  while ((n = syscall(SYS_getdents64, scan->fd, scan->dirents, THREADS_DIRENT_BATCH_SIZE)) > 0) {
+    for (long offset = 0; offset < n;) {
+      struct CapNGDirent64* entry = (struct CapNGDirent64*)(scan->dirents + offset);
+      char* end = NULL;
+      long tid = 0;
+      int fd = -1;
+      int result = 0;
+
+      offset += entry->d_reclen;
+      tid = strtol(entry->d_name, &end, 10);
+      if (*end != '\0' || tid <= 0)
+        continue;
+
+      if (scan->nthreads == scan->capacity) {
+        scan->capacity = scan->capacity ? scan->capacity * 2 : 16;
+        REALLOC_N(scan->threads, ProcStatus, scan->capacity);
+      }
+
+      /* A thread which exits in the meantime is simply left out. */
+      snprintf(path, sizeof(path), "%ld/status", tid);
+      fd = openat(scan->fd, path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        continue;
+      result = read_proc_status_fd(
+        fd, &scan->threads[scan->nthreads], scan->status_buffer, sizeof(scan->status_buffer));
+      close(fd);
+      if (result != 0 || !(scan->threads[scan->nthreads].found & PROC_STATUS_EFFECTIVE))
+        continue;
+
+      scan->threads[scan->nthreads].pid = (int)tid;
+      scan->nthreads++;
+    }
+  }
+  if (n < 0)
+    rb_sys_fail("getdents64");
+
+  for (size_t i = 0; i < scan->nthreads; i++) {
+    if (scan->threads[i].pid == scan->threads[i].tgid) {
+      leader = &scan->threads[i];
+      break;
+    }
+  }
+
+  rb_threads = rb_ary_new_capa((long)scan->nthreads);
+  for (size_t i = 0; i < scan->nthreads; i++) {
+    const ProcStatus* status = &scan->threads[i];
+    VALUE rb_thread = rb_hash_new();
+
+    rb_hash_aset(rb_thread, ID2SYM(rb_intern("tid")), INT2NUM(status->pid));
+    rb_hash_aset(rb_thread, ID2SYM(rb_intern("name")), rb_str_new_cstr(status->name));
+    rb_hash_aset(rb_thread, ID2SYM(rb_intern("effective")), ULL2NUM(status->sets.effective));
+    rb_hash_aset(rb_thread, ID2SYM(rb_intern("permitted")), ULL2NUM(status->sets.permitted));
+    rb_hash_aset(
+      rb_thread, ID2SYM(rb_intern("inheritable")), ULL2NUM(status->sets.inheritable));
+    rb_hash_aset(rb_thread, ID2SYM(rb_intern("bounding")), ULL2NUM(status->sets.bounding));
+    rb_hash_aset(rb_thread, ID2SYM(rb_intern("ambient")), ULL2NUM(status->sets.ambient));
+    rb_hash_aset(rb_thread,
+                 ID2SYM(rb_intern("diverged")),
+                 leader && !capng_threads_same_sets(&leader->sets, &status->sets) ? Qtrue
+                                                                                 : Qfalse);
+    rb_ary_push(rb_threads, rb_thread);
+  }
+
+  return rb_threads;
+}
+
+static VALUE
+capng_threads_release(VALUE arg)
+{
+  struct CapNGThreads* scan = (struct CapNGThreads*)arg;
+
+  if (scan->fd >= 0)
+    close(scan->fd);
+  xfree(scan->dirents);
+  xfree(scan->threads);
+  xfree(scan);
+
+  return Qnil;
+}
+
+/*
+ * Read the capabilities of every thread of a process.
+ *
+ * @overload thread_capabilities(pid = Process.pid)
+ *   @param pid [Integer] Process to inspect.
+ *
+ * @raise [SystemCallError] The process doesn't exist or can't be read.
+ *
+ * @return [Array<Hash>] tid, name and the capability masks of each
+ *   thread. :diverged is true for threads whose sets differ from the
+ *   thread-group leader's.
+ *
+ */
+static VALUE
+rb_capng_s_thread_capabilities(int argc, VALUE* argv, VALUE self)
+{
+  struct CapNGThreads* scan = NULL;
+  VALUE rb_pid = Qnil;
+  char path[64];
+  int pid = 0;
+
+  rb_scan_args(argc, argv, "01", &rb_pid);
+  pid = NIL_P(rb_pid) ? (int)getpid() : NUM2INT(rb_pid);
+  if (pid <= 0)
+    rb_raise(rb_eArgError, "Invalid pid: %d", pid);
+
+  snprintf(path, sizeof(path), "/proc/%d/task", pid);
+  scan = ZALLOC(struct CapNGThreads);
+  scan->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (scan->fd < 0) {
+    int error = errno;
+    xfree(scan);
+    rb_syserr_fail(error, path);
+  }
+  scan->dirents = ALLOC_N(char, THREADS_DIRENT_BATCH_SIZE);
+
+  return rb_ensure(capng_threads_perform, (VALUE)scan, capng_threads_release, (VALUE)scan);
+}
+
+void
+Init_capng_threads(VALUE rb_cCapNG)
+{
+  rb_define_singleton_method(
+    rb_cCapNG, "thread_capabilities", rb_capng_s_thread_capabilities, -1);
+}
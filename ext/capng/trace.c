@@ -0,0 +1,231 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+
+/* Opt-in trace of state-changing calls.
+ *
+ * Entries go into a fixed-size ring shared by every thread. A writer
+ * claims a sequence number with one atomic increment and publishes the
+ * entry by storing that number last, seqlock style, so recording never
+ * takes a lock and never allocates. Readers skip entries being written
+ * or overwritten meanwhile. While tracing is disabled a call costs one
+ * relaxed load. */
+
+#include <capng.h>
+
+#include <string.h>
+#include <time.h>
+
+/* Power of two. */
+#define TRACE_CAPACITY 1024
+
+struct CapNGTraceEntry
+{
+  /* Sequence number + 1, or 0 while being written. */
+  unsigned long sequence;
+  uint64_t time;
+  int tid;
+  int operation;
+  int args[3];
+  uint64_t masks[2];
+  int result;
+  int error;
+};
+
+int trace_enabled;
+static unsigned long trace_head;
+static unsigned long trace_floor;
+static struct CapNGTraceEntry trace_ring[TRACE_CAPACITY];
+
+static ID id_operations[TRACE_AMBIENT_HANDOFF + 1];
+
+void
+trace_record(TraceOperation operation,
+             int arg0,
+             int arg1,
+             int arg2,
+             uint64_t mask0,
+             uint64_t mask1,
+             int result,
+             int error)
+{
+  unsigned long sequence = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+  struct CapNGTraceEntry* entry = &trace_ring[sequence & (TRACE_CAPACITY - 1)];
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  __atomic_store_n(&entry->sequence, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  entry->time = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+  entry->tid = kernel_gettid();
+  entry->operation = operation;
+  entry->args[0] = arg0;
+  entry->args[1] = arg1;
+  entry->args[2] = arg2;
+  entry->masks[0] = mask0;
+  entry->masks[1] = mask1;
+  entry->result = result;
+  entry->error = error;
+  __atomic_store_n(&entry->sequence, sequence + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Start recording state-changing calls.
+ *
+ * @return [nil]
+ *
+ */
+static VALUE
+rb_capng_s_trace_enable(VALUE self)
+{
+  __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELAXED);
+
+  return Qnil;
+}
+
+/*
+ * Stop recording. Recorded entries are kept.
+ *
+ * @return [nil]
+ *
+ */
+static VALUE
+rb_capng_s_trace_disable(VALUE self)
+{
+  __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+
+  return Qnil;
+}
+
+/*
+ * Check whether calls are recorded.
+ *
+ * @return [Boolean]
+ *
+ */
+static VALUE
+rb_capng_s_trace_enabled_p(VALUE self)
+{
+  return __atomic_load_n(&trace_enabled, __ATOMIC_RELAXED) ? Qtrue : Qfalse;
+}
+
+/*
+ * Forget every recorded entry.
+ *
+ * @return [nil]
+ *
+ */
+static VALUE
+rb_capng_s_trace_clear(VALUE self)
+{
+  unsigned long head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+
+  __atomic_store_n(&trace_floor, head, __ATOMIC_RELEASE);
+
+  return Qnil;
+}
+
+/*
+ * Read out the recorded calls, oldest first. Only the last 1024 are kept.
+ *
+ * Each entry has :sequence, :time, :tid, :operation, :args, :masks,
+ * :result and :errno. :args and :masks depend on the operation:
+ *
+ * - :update - args: [action, type], masks: [capability]
+ * - :clear, :fill - args: [select]
+ * - :apply - args: [select, select reaching the kernel],
+ *   masks: [effective, permitted]
+ * - :change_id - args: [uid, gid, flags]
+ * - :transition - args: [uid, gid, flags], masks: [kept capabilities]
+ * - :state_restore - masks: [effective, permitted] of the restored state
+ * - :apply_all_threads - args: [select, threads, failed threads],
+ *   masks: [effective, permitted]
+ * - :privilege_drop - args: [uid, gid, failed step or -1],
+ *   masks: [permitted, ambient]
+ * - :ambient_handoff - masks: [ambient]
+ *
+ * @return [Array<Hash>]
+ *
+ */
+static VALUE
+rb_capng_s_trace_dump(VALUE self)
+{
+  unsigned long head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+  unsigned long first = __atomic_load_n(&trace_floor, __ATOMIC_ACQUIRE);
+  VALUE rb_entries = rb_ary_new();
+
+  if (head - first > TRACE_CAPACITY)
+    first = head - TRACE_CAPACITY;
+
+  for (unsigned long sequence = first; sequence < head; sequence++) {
+    const struct CapNGTraceEntry* slot = &trace_ring[sequence & (TRACE_CAPACITY - 1)];
+    struct CapNGTraceEntry entry;
+    VALUE rb_entry;
+
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != sequence + 1)
+      continue;
+    memcpy(&entry, slot, sizeof(entry));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence + 1)
+      continue;
+
+    rb_entry = rb_hash_new();
+    rb_hash_aset(rb_entry, ID2SYM(rb_intern("sequence")), ULONG2NUM(sequence));
+    rb_hash_aset(rb_entry,
+                 ID2SYM(rb_intern("time")),
+                 rb_time_nano_new((time_t)(entry.time / 1000000000),
+                                  (long)(entry.time % 1000000000)));
+    rb_hash_aset(rb_entry, ID2SYM(rb_intern("tid")), INT2NUM(entry.tid));
+    rb_hash_aset(
+      rb_entry, ID2SYM(rb_intern("operation")), ID2SYM(id_operations[entry.operation]));
+    rb_hash_aset(rb_entry,
+                 ID2SYM(rb_intern("args")),
+                 rb_ary_new_from_args(3,
+                                      INT2NUM(entry.args[0]),
+                                      INT2NUM(entry.args[1]),
+                                      INT2NUM(entry.args[2])));
+    rb_hash_aset(rb_entry,
+                 ID2SYM(rb_intern("masks")),
+                 rb_ary_new_from_args(
+                   2, ULL2NUM(entry.masks[0]), ULL2NUM(entry.masks[1])));
+    rb_hash_aset(rb_entry, ID2SYM(rb_intern("result")), INT2NUM(entry.result));
+    rb_hash_aset(rb_entry, ID2SYM(rb_intern("errno")), INT2NUM(entry.error));
+    rb_ary_push(rb_entries, rb_entry);
+  }
+
+  return rb_entries;
+}
+
+void
+Init_capng_trace(VALUE rb_cCapNG)
+{
+  id_operations[0] = rb_intern("unknown");
+  id_operations[TRACE_UPDATE] = rb_intern("update");
+  id_operations[TRACE_CLEAR] = rb_intern("clear");
+  id_operations[TRACE_FILL] = rb_intern("fill");
+  id_operations[TRACE_APPLY] = rb_intern("apply");
+  id_operations[TRACE_LOCK] = rb_intern("lock");
+  id_operations[TRACE_CHANGE_ID] = rb_intern("change_id");
+  id_operations[TRACE_STATE_RESTORE] = rb_intern("state_restore");
+  id_operations[TRACE_TRANSITION] = rb_intern("transition");
+  id_operations[TRACE_APPLY_ALL_THREADS] = rb_intern("apply_all_threads");
+  id_operations[TRACE_PRIVILEGE_DROP] = rb_intern("privilege_drop");
+  id_operations[TRACE_AMBIENT_HANDOFF] = rb_intern("ambient_handoff");
+
+  rb_define_singleton_method(rb_cCapNG, "trace_enable", rb_capng_s_trace_enable, 0);
+  rb_define_singleton_method(rb_cCapNG, "trace_disable", rb_capng_s_trace_disable, 0);
+  rb_define_singleton_method(rb_cCapNG, "trace_enabled?", rb_capng_s_trace_enabled_p, 0);
+  rb_define_singleton_method(rb_cCapNG, "trace_clear", rb_capng_s_trace_clear, 0);
+  rb_define_singleton_method(rb_cCapNG, "trace_dump", rb_capng_s_trace_dump, 0);
+}
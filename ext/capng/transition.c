@@ -0,0 +1,217 @@
+/* capng_c */
+/* Copyright 2020- Hiroshi Hatake*/
+/* */
+/* Licensed under the Apache License, Version 2.0 (the "License"); */
+/* you may not use this file except in compliance with the License. */
+/* You may obtain a copy of the License at */
+/*     http://www.apache.org/licenses/LICENSE-2.0 */
+/* Unless required by applicable law or agreed to in writing, software */
+/* distributed under the License is distributed on an "AS IS" BASIS, */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. */
+/* See the License for the specific language governing permissions and */
+/* limitations under the License. */
+
+
+/* One-shot privilege transition on top of capng_change_id(). */
+
+#include <capng.h>
+
+#include <errno.h>
+#include <grp.h>
+#include <string.h>
+#include <unistd.h>
+
+static VALUE rb_eCapNGTransitionError;
+
+/* Steps named after the failure codes documented in capng_change_id(3). */
+static const char*
+capng_change_id_step(int result)
+{
+  switch (result) {
+    case -1:
+      return "init";
+    case -2:
+      return "keepcaps";
+    case -3:
+      return "intermediate_caps";
+    case -4:
+      return "setresgid";
+    case -5:
+      return "supplementary_groups";
+    case -6:
+      return "setresuid";
+    case -7:
+      return "clear_keepcaps";
+    case -8:
+      return "clear_bounding";
+    case -9:
+      return "drop_setpcap";
+    case -10:
+      return "initgroups";
+    default:
+      return "change_id";
+  }
+}
+
+static void
+capng_transition_fail(const char* step, int error, int result)
+{
+  VALUE rb_error;
+  VALUE rb_message = rb_sprintf("Couldn't transition privileges at %s", step);
+
+  /* Not every capng_change_id() failure sets errno. */
+  if (error)
+    rb_str_catf(rb_message, ": %s", strerror(error));
+  if (result)
+    rb_str_catf(rb_message, " (capng_change_id: %d)", result);
+
+  rb_error = rb_exc_new_str(rb_eCapNGTransitionError, rb_message);
+  rb_ivar_set(rb_error, rb_intern("@step"), ID2SYM(rb_intern(step)));
+  rb_ivar_set(rb_error, rb_intern("@errno"), error ? INT2NUM(error) : Qnil);
+  rb_exc_raise(rb_error);
+}
+
+/*
+ * Switch to another user in one call: set the supplementary groups,
+ * change the ids through capng_change_id() with CAPNG_CLEAR_BOUNDING,
+ * keep the given capabilities, and optionally lock the securebits.
+ *
+ * @overload transition(uid:, gid: nil, groups: nil, keep: [], lock: true)
+ *   @param uid [Integer, String] Target user.
+ *   @param gid [Integer] Target group. Defaults to the user's primary group.
+ *   @param groups [Array<Integer>, nil] Supplementary groups. nil
+ *     initializes them from the group database (CAPNG_INIT_SUPP_GRP), an
+ *     empty Array drops them (CAPNG_DROP_SUPP_GRP).
+ *   @param keep [Array, Symbol, String, Integer, Hash] Capabilities kept in the
+ *     effective and permitted sets, or {mask: Integer}.
+ *   @param lock [Boolean] Lock the securebits like #lock before the ids
+ *     change.
+ *
+ * The steps run in order and aren't rolled back: when locking or changing
+ * the ids fails, the supplementary groups have already been replaced, and
+ * the securebits may be locked. The calling thread should give up rather
+ * than carry on with the mixed state.
+ *
+ * @raise [ArgumentError] The user is unknown or there are more groups than
+ *   the system allows.
+ * @raise [CapNG::TransitionError] A step failed. #step names it.
+ *
+ * @return [true]
+ *
+ */
+static VALUE
+rb_capng_transition(int argc, VALUE* argv, VALUE self)
+{
+  static ID keyword_ids[5];
+  VALUE rb_options, kwargs[5];
+  VALUE rb_groups = Qnil;
+  uid_t user_uid = 0;
+  gid_t user_gid = 0;
+  int found, uid, gid = -1, result = 0, error = 0;
+  capng_flags_t flags = CAPNG_CLEAR_BOUNDING;
+  uint64_t keep = 0;
+  gid_t* groups = NULL;
+
+  if (!keyword_ids[0]) {
+    keyword_ids[0] = rb_intern("uid");
+    keyword_ids[1] = rb_intern("gid");
+    keyword_ids[2] = rb_intern("groups");
+    keyword_ids[3] = rb_intern("keep");
+    keyword_ids[4] = rb_intern("lock");
+  }
+
+  rb_scan_args(argc, argv, ":", &rb_options);
+  rb_get_kwargs(rb_options, keyword_ids, 1, 4, kwargs);
+
+  found = capng_lookup_user(kwargs[0], &user_uid, &user_gid, NULL, 0) == 0;
+  uid = (int)user_uid;
+
+  if (kwargs[1] != Qundef && !NIL_P(kwargs[1]))
+    gid = NUM2INT(kwargs[1]);
+  else if (found)
+    gid = (int)user_gid;
+  else
+    rb_raise(rb_eArgError, "gid is required for a uid without a passwd entry");
+
+  if (kwargs[2] != Qundef && !NIL_P(kwargs[2])) {
+    rb_groups = rb_Array(kwargs[2]);
+    if (RARRAY_LEN(rb_groups) == 0) {
+      flags |= CAPNG_DROP_SUPP_GRP;
+      rb_groups = Qnil;
+    } else if (RARRAY_LEN(rb_groups) > sysconf(_SC_NGROUPS_MAX)) {
+      /* setgroups(2) refuses more anyway; this also bounds the ALLOCA_N below. */
+      rb_raise(rb_eArgError,
+               "Too many supplementary groups: %ld (max %ld)",
+               RARRAY_LEN(rb_groups),
+               sysconf(_SC_NGROUPS_MAX));
+    }
+  } else {
+#if defined(HAVE_CONST_CAPNG_INIT_SUPP_GRP)
+    if (!found)
+      rb_raise(rb_eArgError, "groups are required for a uid without a passwd entry");
+    flags |= CAPNG_INIT_SUPP_GRP;
+#else
+    rb_raise(rb_eArgError, "groups are required with this libcap-ng");
+#endif
+  }
+
+  if (kwargs[3] != Qundef && !NIL_P(kwargs[3]))
+    keep = value_to_requested_mask(kwargs[3]);
+
+  if (!NIL_P(rb_groups)) {
+    long ngroups = RARRAY_LEN(rb_groups);
+    groups = ALLOCA_N(gid_t, ngroups);
+    for (long i = 0; i < ngroups; i++) {
+      groups[i] = (gid_t)NUM2UINT(RARRAY_AREF(rb_groups, i));
+    }
+    if (setgroups((size_t)ngroups, groups) != 0)
+      capng_transition_fail("setgroups", errno, 0);
+  }
+
+  ractor_state_enter();
+  capng_setpid(kernel_gettid());
+  ractor_state_setpid(0);
+  capng_clear(CAPNG_SELECT_BOTH);
+  for (unsigned int capability = 0; capability <= CAPNG_C_LAST_CAP; capability++) {
+    if (keep & CAPNG_C_MASK(capability))
+      capng_update(CAPNG_ADD, CAPNG_EFFECTIVE | CAPNG_PERMITTED, capability);
+  }
+  /* capng_lock() needs CAP_SETPCAP, which capng_change_id() gives up,
+   * so lock first. The locked bits leave PR_SET_KEEPCAPS usable. */
+  if (kwargs[4] == Qundef || RTEST(kwargs[4])) {
+    if (capng_lock() != 0) {
+      result = 1;
+      error = errno;
+    }
+  }
+  if (result == 0) {
+    errno = 0;
+    result = capng_change_id(uid, gid, flags);
+    error = errno;
+  }
+  ractor_state_leave();
+  TRACE_RECORD(TRACE_TRANSITION, uid, gid, flags, keep, 0, result, error);
+  invalidate_applied_capabilities();
+  invalidate_current_capability_sets();
+
+  if (result < 0)
+    capng_transition_fail(capng_change_id_step(result), error, result);
+  if (result > 0)
+    capng_transition_fail("lock", error, 0);
+
+  return Qtrue;
+}
+
+void
+Init_capng_transition(VALUE rb_cCapNG)
+{
+  /* Raised by CapNG#transition. #step is a Symbol naming the failed step
+   * and #errno the errno it failed with, or nil when none was set. */
+  rb_eCapNGTransitionError =
+    rb_define_class_under(rb_cCapNG, "TransitionError", rb_eRuntimeError);
+  rb_define_attr(rb_eCapNGTransitionError, "step", 1, 0);
+  rb_define_attr(rb_eCapNGTransitionError, "errno", 1, 0);
+
+  rb_define_method(rb_cCapNG, "transition", rb_capng_transition, -1);
+  rb_define_singleton_method(rb_cCapNG, "transition", rb_capng_transition, -1);
+}
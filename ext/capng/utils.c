@@ -78,3 +78,186 @@ capability_type_name_to_capability_type(char* capability_name)
     rb_raise(rb_eArgError, "unknown capability name: %s", capability_name);
   }
 }
+
+capng_select_t
+value_to_select_type(VALUE rb_select_name_or_enum)
+{
+  switch (TYPE(rb_select_name_or_enum)) {
+    case T_SYMBOL:
+      return select_name_to_select_type(RSTRING_PTR(rb_sym2str(rb_select_name_or_enum)));
+    case T_STRING:
+      return select_name_to_select_type(StringValuePtr(rb_select_name_or_enum));
+    case T_FIXNUM:
+      return NUM2INT(rb_select_name_or_enum);
+    default:
+      rb_raise(rb_eArgError,
+               "Expected a String or a Symbol instance, or a capability type constant");
+  }
+}
+
+capng_type_t
+value_to_capability_type(VALUE rb_capability_name_or_type)
+{
+  switch (TYPE(rb_capability_name_or_type)) {
+    case T_SYMBOL:
+      return capability_type_name_to_capability_type(
+        RSTRING_PTR(rb_sym2str(rb_capability_name_or_type)));
+    case T_STRING:
+      return capability_type_name_to_capability_type(
+        StringValuePtr(rb_capability_name_or_type));
+    case T_FIXNUM:
+      return NUM2INT(rb_capability_name_or_type);
+    default:
+      rb_raise(rb_eArgError,
+               "Expected a String or a Symbol instance, or a capability type constant");
+  }
+}
+
+unsigned int
+value_to_capability(VALUE rb_capability_or_name)
+{
+  int capability = 0;
+
+  switch (TYPE(rb_capability_or_name)) {
+    case T_SYMBOL:
+      capability =
+        capng_name_to_capability(RSTRING_PTR(rb_sym2str(rb_capability_or_name)));
+      if (capability == -1) {
+        rb_raise(rb_eRuntimeError, "Unknown capability: %s",
+                 RSTRING_PTR(rb_sym2str(rb_capability_or_name)));
+      }
+      break;
+    case T_STRING:
+      capability = capng_name_to_capability(StringValuePtr(rb_capability_or_name));
+      if (capability == -1) {
+        rb_raise(rb_eRuntimeError, "Unknown capability: %s",
+                 StringValuePtr(rb_capability_or_name));
+      }
+      break;
+    case T_FIXNUM:
+      capability = NUM2INT(rb_capability_or_name);
+      if (capability < 0 || capability > CAPNG_C_LAST_CAP) {
+        rb_raise(rb_eRuntimeError, "Unknown capability: %d", capability);
+      }
+      break;
+    default:
+      rb_raise(rb_eArgError,
+               "Expected a String or a Symbol instance, or a capability constant");
+  }
+
+  return (unsigned int)capability;
+}
+
+const char*
+capability_name(unsigned int capability)
+{
+  static const char* names[CAPNG_C_LAST_CAP + 1];
+  static int initialized = 0;
+
+  if (!initialized) {
+    for (int i = 0; capabilityInfoTable[i].name != NULL; i++) {
+      if (capabilityInfoTable[i].code <= CAPNG_C_LAST_CAP)
+        names[capabilityInfoTable[i].code] = capabilityInfoTable[i].name;
+    }
+    initialized = 1;
+  }
+
+  return capability <= CAPNG_C_LAST_CAP ? names[capability] : NULL;
+}
+
+uint64_t
+capability_mask(capng_type_t capability_type)
+{
+  uint64_t mask = 0;
+
+  for (int i = 0; capabilityInfoTable[i].name != NULL; i++) {
+    if (capabilityInfoTable[i].code > CAPNG_C_LAST_CAP)
+      continue;
+    if (capng_have_capability(capability_type, capabilityInfoTable[i].code) == 1)
+      mask |= CAPNG_C_MASK(capabilityInfoTable[i].code);
+  }
+
+  return mask;
+}
+
+/* A bare Integer is a capability constant, as in #update. A mask, e.g.
+ * built by CapNG::Capability.mask, has to be passed as {mask: Integer}. */
+uint64_t
+value_to_requested_mask(VALUE rb_capabilities_or_mask)
+{
+  VALUE rb_mask = Qnil;
+
+  if (!RB_TYPE_P(rb_capabilities_or_mask, T_HASH))
+    return value_to_capability_mask(rb_capabilities_or_mask);
+
+  if (RHASH_SIZE(rb_capabilities_or_mask) == 1)
+    rb_mask = rb_hash_lookup2(rb_capabilities_or_mask, ID2SYM(rb_intern("mask")), Qnil);
+  if (!RB_INTEGER_TYPE_P(rb_mask) || RTEST(rb_funcall(rb_mask, rb_intern("negative?"), 0)))
+    rb_raise(rb_eArgError, "Expected {mask: Integer}: %+" PRIsVALUE, rb_capabilities_or_mask);
+
+  return NUM2ULL(rb_mask);
+}
+
+uint64_t
+value_to_capability_mask(VALUE rb_capabilities)
+{
+  uint64_t mask = 0;
+
+  if (!RB_TYPE_P(rb_capabilities, T_ARRAY))
+    return CAPNG_C_MASK(value_to_capability(rb_capabilities));
+
+  for (long i = 0; i < RARRAY_LEN(rb_capabilities); i++) {
+    mask |= CAPNG_C_MASK(value_to_capability(RARRAY_AREF(rb_capabilities, i)));
+  }
+
+  return mask;
+}
+
+uint64_t
+capability_sets_mask(const CapabilitySets* sets, capng_type_t capability_type)
+{
+  switch (capability_type) {
+    case CAPNG_EFFECTIVE:
+      return sets->effective;
+    case CAPNG_PERMITTED:
+      return sets->permitted;
+    case CAPNG_INHERITABLE:
+      return sets->inheritable;
+    case CAPNG_BOUNDING_SET:
+      return sets->bounding;
+#if defined(HAVE_CONST_CAPNG_AMBIENT)
+    case CAPNG_AMBIENT:
+      return sets->ambient;
+#endif
+    default:
+      rb_raise(rb_eArgError, "Expected a single capability type: %d", capability_type);
+  }
+}
+
+void
+load_capability_sets(const CapabilitySets* sets)
+{
+  static const capng_type_t types[] = {
+    CAPNG_EFFECTIVE,
+    CAPNG_PERMITTED,
+    CAPNG_INHERITABLE,
+    CAPNG_BOUNDING_SET,
+#if defined(HAVE_CONST_CAPNG_AMBIENT)
+    CAPNG_AMBIENT,
+#endif
+  };
+  capng_select_t select = CAPNG_SELECT_BOTH;
+
+#if defined(HAVE_CONST_CAPNG_SELECT_AMBIENT)
+  select |= CAPNG_SELECT_AMBIENT;
+#endif
+  capng_clear(select);
+
+  for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+    uint64_t mask = capability_sets_mask(sets, types[i]);
+    for (unsigned int capability = 0; mask; capability++, mask >>= 1) {
+      if (mask & 1)
+        capng_update(CAPNG_ADD, types[i], capability);
+    }
+  }
+}
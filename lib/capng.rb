@@ -15,41 +15,183 @@ class CapNG
   # @private
   alias_method :update_raw, :update
 
-  def caps_file(file_or_string_path)
-    if file_or_string_path.is_a?(String) && File.exist?(file_or_string_path)
-      File.open(file_or_string_path) do |f|
-        caps_file_raw(f)
+  class << self
+    # :nodoc:
+    # @private
+    alias_method :caps_file_raw, :caps_file
+    # :nodoc:
+    # @private
+    alias_method :apply_caps_file_raw, :apply_caps_file
+    # :nodoc:
+    # @private
+    alias_method :update_raw, :update
+  end
+
+  # Iterate over processes holding all of the given capabilities in the
+  # given set. /proc is read incrementally, so stopping early (e.g. with
+  # #first or break) also stops the scan.
+  #
+  # @param filter [Array, Symbol, String, Integer, Hash, nil] Capability names
+  #   or constants, or {mask: Integer} for a mask.
+  # @param type [Symbol] :effective, :permitted, :inheritable, :bounding_set or :ambient.
+  # @return [Enumerator::Lazy] without a block.
+  def self.each_process(filter: nil, type: :effective, &block)
+    return enum_for(__method__, filter: filter, type: type).lazy unless block
+
+    each_process_raw(filter, type, &block)
+  end
+
+  # Wrappers shared by instances and the module-level functions, e.g.
+  # CapNG.new.update and CapNG.update.
+  module Wrappers
+    def caps_file(file_or_string_path)
+      if file_or_string_path.is_a?(String) && File.exist?(file_or_string_path)
+        File.open(file_or_string_path) do |f|
+          caps_file_raw(f)
+        end
+      elsif file_or_string_path.is_a?(File)
+        caps_file_raw(file_or_string_path)
+      else
+        raise ArgumentError, "#{file_or_string_path} should be File class or String class instance."
+      end
+    end
+
+    def apply_caps_file(file_or_string_path)
+      if file_or_string_path.is_a?(String) && File.exist?(file_or_string_path)
+        File.open(file_or_string_path) do |f|
+          apply_caps_file_raw(f)
+        end
+      elsif file_or_string_path.is_a?(File)
+        apply_caps_file_raw(file_or_string_path)
+      else
+        raise ArgumentError, "#{file_or_string_path} should be File class or String class instance."
+      end
+    end
+
+    def update(action, type, capability_or_capability_array)
+      if capability_or_capability_array.is_a?(Array) && !capability_or_capability_array.empty?
+        results = []
+        capability_or_capability_array.each do |capability|
+          result = update_raw(action, type, capability)
+          results << result
+          return results if !result
+        end
+        results
+      else
+        update_raw(action, type, capability_or_capability_array)
       end
-    elsif file_or_string_path.is_a?(File)
-      caps_file_raw(file_or_string_path)
-    else
-      raise ArgumentError, "#{file_or_string_path} should be File class or String class instance."
     end
   end
+  prepend Wrappers
+  singleton_class.prepend Wrappers
 
-  def apply_caps_file(file_or_string_path)
-    if file_or_string_path.is_a?(String) && File.exist?(file_or_string_path)
-      File.open(file_or_string_path) do |f|
-        apply_caps_file_raw(f)
+  class PrivilegeDrop
+    # Fork a child which drops privileges before running the given block.
+    # A child which can't drop them exits with status 127 without running
+    # the block or any code inherited from the parent, e.g. at_exit handlers.
+    def fork
+      Process.fork do
+        begin
+          apply
+        rescue Exception => e
+          begin
+            $stderr.write("CapNG::PrivilegeDrop: #{e.message}\n")
+          ensure
+            exit!(127)
+          end
+        end
+        yield if block_given?
       end
-    elsif file_or_string_path.is_a?(File)
-      apply_caps_file_raw(file_or_string_path)
-    else
-      raise ArgumentError, "#{file_or_string_path} should be File class or String class instance."
     end
   end
 
-  def update(action, type, capability_or_capability_array)
-    if capability_or_capability_array.is_a?(Array) && !capability_or_capability_array.empty?
-      results = []
-      capability_or_capability_array.each do |capability|
-        result = update_raw(action, type, capability)
-        results << result
-        return results if !result
-      end
-      results
-    else
-      update_raw(action, type, capability_or_capability_array)
+  class AmbientHandoff
+    # :nodoc:
+    # @private
+    module ForkHook
+      def _fork
+        pid = super
+        if pid == 0 && (handoff = CapNG::AmbientHandoff.installed)
+          handoff.apply or AmbientHandoff.child_failed
+        end
+        pid
+      end
+    end
+
+    class << self
+      # The handoff applied in every child created by Process.fork/Kernel#fork.
+      attr_reader :installed
+
+      # :nodoc:
+      # @private
+      #
+      # Leave a child whose ambient capabilities couldn't be raised without
+      # running any code inherited from the parent, e.g. at_exit handlers.
+      def child_failed
+        $stderr.write("CapNG::AmbientHandoff: couldn't raise ambient capabilities\n")
+      ensure
+        exit!(127)
+      end
+    end
+
+    # Fork a child process which holds the prepared ambient capabilities
+    # before running the given block. A child which can't raise them exits
+    # with status 127 before the block runs.
+    def fork
+      Process.fork do
+        apply or AmbientHandoff.child_failed
+        yield if block_given?
+      end
+    end
+
+    # Same as Process.spawn, except that the prepared ambient capabilities
+    # are raised in the child before exec. Like Process.spawn, an exec
+    # failure is raised in the caller.
+    #
+    # @raise [SystemCallError] The command couldn't be executed.
+    # @raise [CapNG::Error] The ambient capabilities couldn't be raised.
+    def spawn(*args)
+      reader, writer = IO.pipe
+      pid = Process.fork do
+        reader.close
+        begin
+          raise CapNG::Error, "Couldn't hand off ambient capabilities" unless apply
+          Process.exec(*args)
+        rescue Exception => e
+          # The pipe is close-on-exec, so the caller reads EOF on success.
+          writer.write(Marshal.dump(e)) rescue nil
+        end
+        exit!(127)
+      end
+      writer.close
+      error = reader.read
+      reader.close
+      unless error.empty?
+        Process.wait(pid)
+        raise Marshal.load(error)
+      end
+      pid
+    end
+
+    # Apply this handoff in every child created by Process.fork/Kernel#fork.
+    # Process.spawn and Kernel#system don't call Process._fork, so use #spawn
+    # for them instead.
+    def install
+      unless Process.respond_to?(:_fork)
+        raise NotImplementedError, "Process._fork is not available on Ruby #{RUBY_VERSION}"
+      end
+      unless Process.singleton_class.include?(ForkHook)
+        Process.singleton_class.prepend(ForkHook)
+      end
+      AmbientHandoff.instance_variable_set(:@installed, self)
+      self
+    end
+
+    def uninstall
+      if AmbientHandoff.installed.equal?(self)
+        AmbientHandoff.instance_variable_set(:@installed, nil)
+      end
+      self
     end
   end
 end
@@ -0,0 +1,155 @@
+# Copyright 2020- Hiroshi Hatake
+
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+
+#     http://www.apache.org/licenses/LICENSE-2.0
+
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+require_relative "./helper"
+
+# Hot query methods sit on per-event paths, so they must not allocate Ruby
+# objects when given Symbols or Integers.
+class CapNGAllocationTest < ::Test::Unit::TestCase
+  ITERATIONS = 1000
+
+  def setup
+    @capng = CapNG.new(:current_process)
+    @capability = CapNG::Capability.new
+  end
+
+  # Measured as a Float so that a few allocations over all iterations still
+  # exceed a budget of 0. The first round only warms up: call sites
+  # allocate their inline caches, which are objects too, on first use.
+  def allocations_per_call
+    2.times.map do
+      GC.disable
+      before = GC.stat(:total_allocated_objects)
+      ITERATIONS.times { yield }
+      (GC.stat(:total_allocated_objects) - before).fdiv(ITERATIONS)
+    ensure
+      GC.enable
+    end.last
+  end
+
+  def assert_allocations(budget, &block)
+    allocations = allocations_per_call(&block)
+    assert_operator allocations, :<=, budget,
+                    "#{allocations} objects allocated per call, budget is #{budget}"
+  end
+
+  sub_test_case "have_capability?" do
+    test "Symbol" do
+      assert_allocations(0) { @capng.have_capability?(:effective, :chown) }
+    end
+
+    test "Integer" do
+      assert_allocations(0) do
+        @capng.have_capability?(CapNG::Type::EFFECTIVE, CapNG::Capability::CHOWN)
+      end
+    end
+  end
+
+  sub_test_case "have_capabilities?" do
+    test "Symbol" do
+      assert_allocations(0) { @capng.have_capabilities?(:caps) }
+    end
+
+    test "Integer" do
+      assert_allocations(0) { @capng.have_capabilities?(CapNG::Select::CAPS) }
+    end
+  end
+
+  sub_test_case "update" do
+    test "Symbol" do
+      assert_allocations(0) { @capng.update(:add, :effective, :chown) }
+    end
+
+    test "Integer" do
+      assert_allocations(0) do
+        @capng.update(CapNG::Action::ADD, CapNG::Type::EFFECTIVE, CapNG::Capability::CHOWN)
+      end
+    end
+  end
+
+  sub_test_case "apply" do
+    setup do
+      omit "Needed to run as root" unless Process.uid == 0
+    end
+
+    test "Symbol" do
+      assert_allocations(0) { @capng.apply(:caps) }
+    end
+
+    test "Integer" do
+      assert_allocations(0) { @capng.apply(CapNG::Select::CAPS) }
+    end
+  end
+
+  sub_test_case "Capability#from_name" do
+    test "Symbol" do
+      assert_allocations(0) { @capability.from_name(:chown) }
+    end
+  end
+
+  sub_test_case "module-level functions" do
+    test "CapNG.have_capability?" do
+      assert_allocations(0) { CapNG.have_capability?(:effective, :chown) }
+    end
+
+    test "CapNG.have_capabilities?" do
+      assert_allocations(0) { CapNG.have_capabilities?(:caps) }
+    end
+
+    test "CapNG.update" do
+      assert_allocations(0) { CapNG.update(:add, :effective, :chown) }
+    end
+
+    test "CapNG::Capability.from_name" do
+      assert_allocations(0) { CapNG::Capability.from_name(:chown) }
+    end
+  end
+
+  sub_test_case "status queries" do
+    test "caps_file_status" do
+      File.open(__FILE__) do |file|
+        assert_allocations(0) { CapNG.caps_file_status(file) }
+      end
+    end
+
+    test "caps_process_status" do
+      assert_allocations(0) { CapNG.caps_process_status(Process.pid) }
+    end
+  end
+
+  sub_test_case "Print#caps_text" do
+    test "cached set" do
+      assert_allocations(0) { CapNG::Print.caps_text(:buffer, :effective) }
+    end
+  end
+
+  sub_test_case "Policy" do
+    test "check" do
+      policy = CapNG::Policy.compile(effective: [:chown], bounding: [:chown])
+      assert_allocations(0) { policy.check }
+    end
+  end
+
+  sub_test_case "current thread queries" do
+    test "Symbol" do
+      assert_allocations(0) { CapNG.current_capability?(:effective, :chown) }
+    end
+
+    test "Integer" do
+      assert_allocations(0) do
+        CapNG.current_capability?(CapNG::Type::EFFECTIVE, CapNG::Capability::CHOWN)
+      end
+    end
+  end
+end
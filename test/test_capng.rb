@@ -13,7 +13,12 @@
 # limitations under the License.
 
 require_relative "./helper"
+require 'etc'
+require 'fileutils'
 require 'tempfile'
+require 'tmpdir'
+require 'json'
+require 'stringio'
 
 class CapNGTest < ::Test::Unit::TestCase
   def setup
@@ -23,6 +28,28 @@ class CapNGTest < ::Test::Unit::TestCase
   def teardown
   end
 
+  def kernel_capabilities(field)
+    File.read("/proc/thread-self/status")[/^#{field}:\s*(\h+)/, 1].to_i(16)
+  end
+
+  def set_file_capabilities(path, data)
+    require "fiddle"
+    setxattr = Fiddle::Function.new(Fiddle::Handle::DEFAULT["setxattr"],
+                                    [Fiddle::TYPE_VOIDP, Fiddle::TYPE_VOIDP,
+                                     Fiddle::TYPE_VOIDP, Fiddle::TYPE_SIZE_T,
+                                     Fiddle::TYPE_INT],
+                                    Fiddle::TYPE_INT)
+    setxattr.call(path, "security.capability", data, data.bytesize, 0) == 0
+  end
+
+  def in_child
+    pid = fork do
+      exit!(yield ? 0 : 1)
+    end
+    Process.wait(pid)
+    $?.success?
+  end
+
   sub_test_case "CapNG constants" do
     test "act" do
       assert CapNG::Action::DROP
@@ -148,6 +175,1210 @@ class CapNGTest < ::Test::Unit::TestCase
     end
   end
 
+  sub_test_case "Scoped elevation" do
+    test "requires a block" do
+      assert_raise(LocalJumpError) do
+        CapNG.with_capabilities(:effective, [:chown])
+      end
+    end
+
+    test "bounding set cannot be raised" do
+      assert_raise(ArgumentError) do
+        CapNG.with_capabilities(:bounding_set, [:chown]) {}
+      end
+    end
+
+    test "already held capabilities need no change" do
+      @capng.fill(:caps)
+      result = CapNG.with_capabilities(:effective, [:chown, :dac_read_search]) do
+        assert_true @capng.have_capability?(:effective, :chown)
+        :done
+      end
+      assert_equal :done, result
+      assert_true @capng.have_capability?(:effective, :chown)
+    end
+
+    test "raise and restore around the block" do
+      omit "Needed to run as root" unless Process.uid == 0
+      net_raw = 1 << CapNG::Capability::NET_RAW
+      assert_true(in_child do
+        capng = CapNG.new(:current_process)
+        capng.update(:drop, :effective, :net_raw)
+        capng.apply(:caps)
+        inside = nil
+        begin
+          CapNG.with_capabilities(:effective, [:net_raw]) do
+            inside = kernel_capabilities("CapEff") & net_raw
+            raise "boom"
+          end
+        rescue RuntimeError
+        end
+        inside == net_raw &&
+          (kernel_capabilities("CapEff") & net_raw) == 0 &&
+          !capng.have_capability?(:effective, :net_raw)
+      end)
+    end
+  end
+
+  sub_test_case "Apply" do
+    setup do
+      CapNG.clear_apply_cache
+    end
+
+    test "unchanged sets are not applied again" do
+      omit "Needed to run as root" unless Process.uid == 0
+      assert_true(in_child do
+        capng = CapNG.new(:current_process)
+        before = CapNG.apply_stats
+        3.times { capng.apply(:caps) }
+        capng.update(:drop, :effective, :net_raw)
+        capng.apply(:caps)
+        after = CapNG.apply_stats
+        after[:caps_applied] - before[:caps_applied] == 2 &&
+          after[:caps_elided] - before[:caps_elided] == 2 &&
+          (kernel_capabilities("CapEff") & (1 << CapNG::Capability::NET_RAW)) == 0
+      end)
+    end
+
+    test "clear_apply_cache forces the next apply" do
+      capng = CapNG.new(:current_process)
+      assert_true capng.apply(:caps)
+      CapNG.clear_apply_cache
+      before = CapNG.apply_stats
+      assert_true capng.apply(:caps)
+      assert_equal before[:caps_applied] + 1, CapNG.apply_stats[:caps_applied]
+    end
+  end
+
+  sub_test_case "Ambient handoff" do
+    test "capabilities are resolved once into a mask" do
+      handoff = CapNG::AmbientHandoff.new([:net_bind_service, "dac_read_search"])
+      assert_equal((1 << CapNG::Capability::NET_BIND_SERIVCE) |
+                   (1 << CapNG::Capability::DAC_READ_SEARCH),
+                   handoff.mask)
+    end
+
+    test "unknown capability" do
+      assert_raise(RuntimeError) do
+        CapNG::AmbientHandoff.new([:no_such_capability])
+      end
+    end
+
+    test "apply in a forked child" do
+      omit "Needed to run as root" unless Process.uid == 0
+      omit "Ambient capabilities are not supported" unless defined?(CapNG::Type::AMBIENT)
+      handoff = CapNG::AmbientHandoff.new([:net_bind_service])
+      pid = handoff.fork do
+        exit!(kernel_capabilities("CapAmb") == handoff.mask ? 0 : 1)
+      end
+      Process.wait(pid)
+      assert_true $?.success?
+      assert_equal 0, kernel_capabilities("CapAmb")
+    end
+
+    test "spawned process inherits the ambient set" do
+      omit "Needed to run as root" unless Process.uid == 0
+      omit "Ambient capabilities are not supported" unless defined?(CapNG::Type::AMBIENT)
+      handoff = CapNG::AmbientHandoff.new([:net_bind_service, :dac_read_search])
+      Tempfile.create("capng-") do |tf|
+        pid = handoff.spawn("cat", "/proc/self/status", out: tf.path)
+        Process.wait(pid)
+        assert_equal handoff.mask, File.read(tf.path)[/^CapAmb:\s*(\h+)/, 1].to_i(16)
+      end
+    end
+
+    test "spawn reports exec failures to the caller" do
+      handoff = CapNG::AmbientHandoff.new([:net_bind_service])
+      if Process.uid == 0 && defined?(CapNG::Type::AMBIENT)
+        assert_raise(Errno::ENOENT) do
+          handoff.spawn("/nonexistent/capng-command")
+        end
+      else
+        assert_raise(CapNG::Error) do
+          handoff.spawn("true")
+        end
+      end
+    end
+
+    test "fork exits without running the block when the handoff fails" do
+      omit "Needed to run as root" unless Process.uid == 0
+      omit "Ambient capabilities are not supported" unless defined?(CapNG::Type::AMBIENT)
+      handoff = CapNG::AmbientHandoff.new([:net_bind_service])
+      assert_true(in_child do
+        capng = CapNG.new(:current_process)
+        capng.update(:drop, CapNG::Type::EFFECTIVE | CapNG::Type::PERMITTED, :net_bind_service)
+        capng.apply(:caps)
+        reader, writer = IO.pipe
+        at_exit { writer.write("at_exit") }
+        $stderr.reopen(File::NULL)
+        pid = handoff.fork { writer.write("block") }
+        writer.close
+        Process.wait(pid)
+        $?.exitstatus == 127 && reader.read.empty?
+      end)
+    end
+
+    test "a later apply restores the ambient set the handoff replaced" do
+      omit "Needed to run as root" unless Process.uid == 0
+      omit "Ambient capabilities are not supported" unless defined?(CapNG::Type::AMBIENT)
+      handoff = CapNG::AmbientHandoff.new([:net_bind_service])
+      assert_true(in_child do
+        capng = CapNG.new(:current_process)
+        capng.update(:add, :inheritable, [:chown, :net_bind_service])
+        capng.update(:add, :ambient, :chown)
+        capng.apply(:all)
+        handoff.apply
+        capng.apply(:all)
+        kernel_capabilities("CapAmb") == CapNG::Capability.mask(:chown)
+      end)
+    end
+
+    test "installed handoff applies to every fork" do
+      omit "Needed to run as root" unless Process.uid == 0
+      omit "Ambient capabilities are not supported" unless defined?(CapNG::Type::AMBIENT)
+      omit "Process._fork is not available" unless Process.respond_to?(:_fork)
+      handoff = CapNG::AmbientHandoff.new([:net_bind_service]).install
+      begin
+        assert_true(in_child { kernel_capabilities("CapAmb") == handoff.mask })
+      ensure
+        handoff.uninstall
+      end
+      assert_true(in_child { kernel_capabilities("CapAmb") == 0 })
+    end
+  end
+
+  sub_test_case "Privilege drop" do
+    def status_field(field)
+      File.read("/proc/self/status")[/^#{field}:[ \t]*(.*)$/, 1]
+    end
+
+    test "precomputes groups of the user" do
+      drop = CapNG::PrivilegeDrop.new(uid: 0)
+      assert_equal 0, drop.gid
+      assert_include drop.groups, 0
+      assert_equal [10, 20], CapNG::PrivilegeDrop.new(uid: 0, gid: 0, groups: [10, 20]).groups
+      assert_raise(ArgumentError) do
+        CapNG::PrivilegeDrop.new(uid: 4242424)
+      end
+      assert_raise(ArgumentError) do
+        CapNG::PrivilegeDrop.new(uid: "no-such-user-capng")
+      end
+    end
+
+    test "memsize counts the allocated groups" do
+      require "objspace"
+      one = CapNG::PrivilegeDrop.new(uid: 0, gid: 0, groups: [0])
+      many = CapNG::PrivilegeDrop.new(uid: 0, gid: 0, groups: Array.new(1024, 0))
+      assert_operator ObjectSpace.memsize_of(many) - ObjectSpace.memsize_of(one), :>=, 1023 * 4
+    end
+
+    test "apply in a forked child" do
+      omit "Needed to run as root" unless Process.uid == 0
+      drop = CapNG::PrivilegeDrop.new(uid: 65534, gid: 65534, groups: [65534, 4242],
+                                      keep: [:net_raw, :net_bind_service])
+      pid = drop.fork do
+        mask = CapNG::Capability.mask(:net_raw, :net_bind_service)
+        ok = Process.uid == 65534 && Process.euid == 65534 && Process.gid == 65534 &&
+             status_field("Groups").split.map(&:to_i).sort == [4242, 65534] &&
+             kernel_capabilities("CapEff") == mask &&
+             kernel_capabilities("CapPrm") == mask &&
+             kernel_capabilities("CapBnd") == mask &&
+             CapNG.current_capability?(:effective, :net_raw)
+        exit!(ok ? 0 : 1)
+      end
+      Process.wait(pid)
+      assert_true $?.success?
+    end
+
+    test "changes the ids of every thread" do
+      omit "Needed to run as root" unless Process.uid == 0
+      drop = CapNG::PrivilegeDrop.new(uid: 65534, gid: 65534, groups: [4242],
+                                      keep: [:net_raw])
+      assert_true(in_child do
+        queue = Queue.new
+        thread = Thread.new { queue.pop }
+        Thread.pass until thread.status == "sleep"
+        drop.apply
+        statuses = Dir.glob("/proc/self/task/*/status").map { |path| File.read(path) }
+        queue << nil
+        thread.join
+        statuses.size >= 2 && statuses.all? do |status|
+          status[/^Uid:\s*(.*)$/, 1].split.uniq == ["65534"] &&
+            status[/^Gid:\s*(.*)$/, 1].split.uniq == ["65534"] &&
+            status[/^Groups:\s*(.*)$/, 1].split == ["4242"] &&
+            status[/^CapEff:\s*(\h+)/, 1].hex & ~CapNG::Capability.mask(:net_raw) == 0
+        end
+      end)
+    end
+
+    test "fork exits without running the block when the drop fails" do
+      omit "Run as non-root to check the failure" if Process.uid == 0
+      drop = CapNG::PrivilegeDrop.new(uid: Process.uid, gid: Process.gid, groups: [0])
+      reader, writer = IO.pipe
+      pid = drop.fork do
+        writer.write("ran")
+      end
+      writer.close
+      Process.wait(pid)
+      assert_equal [127, ""], [$?.exitstatus, reader.read]
+    ensure
+      reader&.close
+    end
+
+    test "ambient and unlocked" do
+      omit "Needed to run as root" unless Process.uid == 0
+      drop = CapNG::PrivilegeDrop.new(uid: 65534, gid: 65534, groups: [],
+                                      ambient: [:net_bind_service], bounding: nil, lock: false)
+      assert_true(in_child do
+        drop.apply
+        kernel_capabilities("CapAmb") == CapNG::Capability.mask(:net_bind_service) &&
+          kernel_capabilities("CapEff") == 0 &&
+          status_field("Groups").strip.empty?
+      end)
+    end
+
+    test "reports the failed step" do
+      omit "Run as non-root to check the failure" if Process.uid == 0
+      drop = CapNG::PrivilegeDrop.new(uid: Process.uid, gid: Process.gid, groups: [0])
+      error = assert_raise(RuntimeError) { drop.apply }
+      assert_match(/setgroups/, error.message)
+    end
+  end
+
+  sub_test_case "Transition" do
+    test "switches user, groups and capabilities in one call" do
+      omit "Needed to run as root" unless Process.uid == 0
+      assert_true(in_child do
+        @capng.transition(uid: 65534, gid: 65534, groups: [4242], keep: [:net_raw])
+        Process.uid == 65534 && Process.euid == 65534 && Process.gid == 65534 &&
+          Process.groups == [4242] &&
+          kernel_capabilities("CapEff") == CapNG::Capability.mask(:net_raw) &&
+          kernel_capabilities("CapPrm") == CapNG::Capability.mask(:net_raw) &&
+          kernel_capabilities("CapBnd") == 0
+      end)
+    end
+
+    test "initializes supplementary groups" do
+      omit "Needed to run as root" unless Process.uid == 0
+      omit "INIT_SUPP_GRP is not available" unless defined?(CapNG::Flags::INIT_SUPP_GRP)
+      expected = CapNG::PrivilegeDrop.new(uid: 0).groups.uniq.sort
+      assert_true(in_child do
+        Process.groups = [4242]
+        CapNG.transition(uid: 0, keep: [:net_raw], lock: false)
+        Process.uid == 0 && Process.groups.uniq.sort == expected &&
+          kernel_capabilities("CapEff") == CapNG::Capability.mask(:net_raw)
+      end)
+    end
+
+    test "rejects more groups than the system allows" do
+      too_many = Array.new(Etc.sysconf(Etc::SC_NGROUPS_MAX) + 1) { |i| i }
+      error = assert_raise(ArgumentError) do
+        CapNG.transition(uid: Process.uid, gid: Process.gid, groups: too_many)
+      end
+      assert_match(/Too many supplementary groups/, error.message)
+    end
+
+    test "names the failed step" do
+      omit "Needed to run as root" unless Process.uid == 0
+      assert_true(in_child do
+        Process::Sys.setresgid(65534, 65534, 65534)
+        Process::Sys.setresuid(65534, 65534, 65534)
+        begin
+          CapNG.transition(uid: 0, gid: 0, groups: [0])
+          false
+        rescue CapNG::TransitionError => e
+          e.step == :setgroups && e.errno == Errno::EPERM::Errno && e.is_a?(RuntimeError)
+        end
+      end)
+      assert_true(in_child do
+        Process::Sys.setresgid(65534, 65534, 65534)
+        Process::Sys.setresuid(65534, 65534, 65534)
+        begin
+          CapNG.transition(uid: 0, gid: 0, groups: [])
+          false
+        rescue CapNG::TransitionError => e
+          e.message.include?(e.step.to_s) && e.step != :setgroups
+        end
+      end)
+    end
+
+    test "requires a known user" do
+      assert_raise(ArgumentError) do
+        CapNG.transition(uid: "no-such-user-capng")
+      end
+    end
+  end
+
+  sub_test_case "Ractor" do
+    setup do
+      omit "Ractor is not available" unless defined?(Ractor)
+      @experimental = Warning[:experimental]
+      Warning[:experimental] = false
+    end
+
+    teardown do
+      Warning[:experimental] = @experimental if defined?(Ractor)
+    end
+
+    test "each Ractor has its own state" do
+      capabilities = [:chown, :kill, :net_raw, :sys_time, :fowner, :setuid]
+      ractors = capabilities.map do |capability|
+        Ractor.new(capability) do |cap|
+          capng = CapNG.new
+          print = CapNG::Print.new
+          20.times.all? do
+            capng.clear(:both)
+            capng.update(:add, :effective, cap)
+            # Blocking lets the Ractor move to another native thread.
+            sleep 0.001
+            print.caps_text(:buffer, :effective) == cap.to_s &&
+              capng.have_capability?(:effective, cap)
+          end
+        end
+      end
+      assert_equal [true] * capabilities.size, ractors.map(&:take)
+    end
+
+    test "current process scan in Ractors" do
+      ractors = 4.times.map do
+        Ractor.new do
+          CapNG.new(:current_process)
+          CapNG::Print.new.caps_text(:buffer, :permitted)
+        end
+      end
+      permitted = kernel_capabilities("CapPrm")
+      expected = CapNG::Capability.new.each.select { |code, _| permitted[code] == 1 }
+                                         .map { |_, name| name }.join(", ")
+      expected = "none" if expected.empty?
+      assert_equal [expected] * 4, ractors.map(&:take)
+    end
+  end
+
+  sub_test_case "Capability mask" do
+    test "build masks from names and constants" do
+      assert_equal 0, CapNG::Capability.mask
+      assert_equal((1 << CapNG::Capability::CHOWN) | (1 << CapNG::Capability::KILL),
+                   CapNG::Capability.mask(:chown, "kill"))
+      assert_equal CapNG::Capability.mask(:chown, :kill),
+                   CapNG::Capability.mask([CapNG::Capability::CHOWN, CapNG::Capability::KILL])
+    end
+
+    test "unknown capability" do
+      assert_raise(RuntimeError) do
+        CapNG::Capability.mask(:no_such_capability)
+      end
+    end
+
+    test "mask of the current state" do
+      @capng.clear(:both)
+      assert_equal 0, @capng.capabilities_mask(:effective)
+      @capng.update(:add, :effective, [:chown, :net_raw, :sys_time])
+      @capng.update(:add, :bounding_set, :kill)
+      expected = CapNG::Capability.mask(:chown, :net_raw, :sys_time)
+      assert_equal expected, @capng.capabilities_mask(:effective)
+      assert_equal expected, @capng.capabilities_mask(CapNG::Type::EFFECTIVE)
+      assert_equal CapNG::Capability.mask(:kill), @capng.capabilities_mask(:bounding_set)
+      assert_equal 0, @capng.capabilities_mask(:permitted)
+    end
+  end
+
+  sub_test_case "Capability text" do
+    def mask(*caps)
+      CapNG::Capability.mask(*caps)
+    end
+
+    test "single clause" do
+      assert_equal({effective: mask(:net_raw, :net_bind_service),
+                    permitted: mask(:net_raw, :net_bind_service),
+                    inheritable: mask(:net_raw, :net_bind_service)},
+                   CapNG::Capability.parse_text("cap_net_raw,cap_net_bind_service+eip"))
+    end
+
+    test "multiple clauses and operators" do
+      result = CapNG::Capability.parse_text("cap_chown,cap_kill=ep cap_kill-e  CAP_SETUID+i\n")
+      assert_equal mask(:chown), result[:effective]
+      assert_equal mask(:chown, :kill), result[:permitted]
+      assert_equal mask(:setuid), result[:inheritable]
+
+      result = CapNG::Capability.parse_text("cap_chown=p-e+i")
+      assert_equal 0, result[:effective]
+      assert_equal mask(:chown), result[:permitted]
+      assert_equal mask(:chown), result[:inheritable]
+    end
+
+    test "all and empty lists" do
+      all = CapNG::Capability.new.each.map { |code, _name| code }.select { |code| code < 64 }
+      assert_equal mask(all), CapNG::Capability.parse_text("=ep")[:permitted]
+      assert_equal mask(all), CapNG::Capability.parse_text("all+e")[:effective]
+      assert_equal({effective: 0, permitted: 0, inheritable: 0},
+                   CapNG::Capability.parse_text("="))
+      result = CapNG::Capability.parse_text("=ep cap_sys_admin-ep")
+      assert_equal mask(all) & ~mask(:sys_admin), result[:effective]
+      assert_equal({effective: 0, permitted: 0, inheritable: 0},
+                   CapNG::Capability.parse_text(""))
+    end
+
+    test "numbers and names without prefix" do
+      assert_equal mask(:chown, :kill), CapNG::Capability.parse_text("0,kill+p")[:permitted]
+    end
+
+    test "feeds a policy" do
+      masks = CapNG::Capability.parse_text("cap_chown+ep")
+      policy = CapNG::Policy.compile(**masks.transform_values { |mask| {mask: mask} })
+      assert_equal mask(:chown), policy.effective
+      assert_equal 0, policy.inheritable
+    end
+
+    data("unknown capability" => "cap_nope+p",
+         "missing operator" => "cap_chown",
+         "missing flags" => "cap_chown+",
+         "missing list" => "+p",
+         "trailing garbage" => "cap_chown+px",
+         "empty name" => "cap_chown,,cap_kill+p",
+         "embedded NUL" => "cap_kill\0e",
+         "NUL after the flags" => "cap_kill+p\0")
+    test "malformed" do |text|
+      assert_raise(ArgumentError) do
+        CapNG::Capability.parse_text(text)
+      end
+    end
+  end
+
+  sub_test_case "Multiple capability checks" do
+    setup do
+      @capng.clear(:both)
+      @capng.update(:add, :effective, [:chown, :kill, :net_raw])
+    end
+
+    test "have_capability? with an Array" do
+      assert_true @capng.have_capability?(:effective, [:chown, :kill])
+      assert_false @capng.have_capability?(:effective, [:chown, :sys_admin])
+      assert_true @capng.have_capability?(:effective, [])
+    end
+
+    test "have_all_capabilities?" do
+      assert_true @capng.have_all_capabilities?(:effective, [:chown, "kill", CapNG::Capability::NET_RAW])
+      assert_false @capng.have_all_capabilities?(:effective, [:chown, :sys_admin])
+      assert_true @capng.have_all_capabilities?(:effective, mask: CapNG::Capability.mask(:chown, :kill))
+      assert_false @capng.have_all_capabilities?(:permitted, mask: CapNG::Capability.mask(:chown))
+    end
+
+    test "have_any_capability?" do
+      assert_true @capng.have_any_capability?(:effective, [:sys_admin, :kill])
+      assert_false @capng.have_any_capability?(:effective, [:sys_admin, :sys_boot])
+      assert_true @capng.have_any_capability?(:effective, mask: CapNG::Capability.mask(:net_raw))
+      assert_false @capng.have_any_capability?(:effective, [])
+    end
+
+    test "missing_capabilities" do
+      assert_equal [:sys_admin, "sys_boot"],
+                   @capng.missing_capabilities(:effective, [:chown, :sys_admin, "sys_boot", :kill])
+      assert_equal [], @capng.missing_capabilities(:effective, [:chown, :kill])
+      assert_equal CapNG::Capability.mask(:sys_admin),
+                   @capng.missing_capabilities(:effective, mask: CapNG::Capability.mask(:chown, :sys_admin))
+    end
+
+    test "a bare Integer is a capability constant" do
+      @capng.clear(:caps)
+      assert_false @capng.have_all_capabilities?(:effective, CapNG::Capability::CHOWN)
+      @capng.update(:add, :effective, [:chown, :dac_read_search])
+      assert_false @capng.have_all_capabilities?(:effective, CapNG::Capability::KILL)
+      assert_true @capng.have_any_capability?(:effective, CapNG::Capability::CHOWN)
+      assert_equal CapNG::Capability.mask(:kill),
+                   @capng.missing_capabilities(:effective, CapNG::Capability::KILL)
+    end
+
+    test "malformed mask" do
+      [{mask: -1}, {mask: "1"}, {mask: 1, other: 2}, {bits: 1}].each do |malformed|
+        assert_raise(ArgumentError) do
+          @capng.have_all_capabilities?(:effective, malformed)
+        end
+      end
+    end
+
+    test "unknown capability" do
+      assert_raise(RuntimeError) do
+        @capng.have_all_capabilities?(:effective, [:chown, :no_such_capability])
+      end
+      assert_raise(RuntimeError) do
+        @capng.have_all_capabilities?(:effective, 64)
+      end
+    end
+  end
+
+  sub_test_case "Current thread queries" do
+    data("effective" => [:effective, "CapEff"],
+         "permitted" => [:permitted, "CapPrm"],
+         "inheritable" => [:inheritable, "CapInh"],
+         "bounding_set" => [:bounding_set, "CapBnd"])
+    test "masks match the kernel" do |(type, field)|
+      assert_equal kernel_capabilities(field), CapNG.current_capabilities_mask(type)
+    end
+
+    test "ambient mask matches the kernel" do
+      omit "Ambient capabilities are not supported" unless defined?(CapNG::Type::AMBIENT)
+      assert_equal kernel_capabilities("CapAmb"), CapNG.current_capabilities_mask(:ambient)
+    end
+
+    test "current_capability?" do
+      effective = kernel_capabilities("CapEff")
+      CapNG::Capability.new.each do |code, name|
+        assert_equal effective[code] == 1, CapNG.current_capability?(:effective, name)
+      end
+    end
+
+    test "working state is left untouched" do
+      @capng.clear(:both)
+      @capng.update(:add, :effective, :kill)
+      CapNG.current_capabilities_mask(:effective)
+      CapNG.current_capabilities_mask(:bounding_set)
+      assert_equal CapNG::Capability.mask(:kill), @capng.capabilities_mask(:effective)
+      assert_equal 0, @capng.capabilities_mask(:bounding_set)
+    end
+
+    test "combined types are rejected" do
+      assert_raise(ArgumentError) do
+        CapNG.current_capabilities_mask(CapNG::Type::EFFECTIVE | CapNG::Type::PERMITTED)
+      end
+    end
+  end
+
+  sub_test_case "Current process snapshot" do
+    test "current_process state matches the kernel" do
+      capng = CapNG.new(:current_process)
+      assert_equal kernel_capabilities("CapEff"), capng.capabilities_mask(:effective)
+      assert_equal kernel_capabilities("CapPrm"), capng.capabilities_mask(:permitted)
+      assert_equal kernel_capabilities("CapInh"), capng.capabilities_mask(:inheritable)
+      assert_equal kernel_capabilities("CapBnd"), capng.capabilities_mask(:bounding_set)
+    end
+
+    test "current_process after setpid targets the calling thread" do
+      @capng.setpid(1)
+      capng = CapNG.new(:current_process)
+      assert_equal kernel_capabilities("CapBnd"), capng.capabilities_mask(:bounding_set)
+    end
+
+    test "repeated reads keep the generation" do
+      CapNG.new(:current_process)
+      generation = CapNG.snapshot_generation
+      3.times { CapNG.new(:current_process) }
+      CapNG.current_capability?(:effective, :chown)
+      assert_equal generation, CapNG.snapshot_generation
+    end
+
+    test "state changing operations bump the generation" do
+      generation = CapNG.snapshot_generation
+      @capng.clear(:both)
+      assert_operator CapNG.snapshot_generation, :>, generation
+
+      generation = CapNG.snapshot_generation
+      @capng.fill(:both)
+      assert_operator CapNG.snapshot_generation, :>, generation
+
+      generation = CapNG.snapshot_generation
+      state = CapNG::State.new
+      state.save
+      state.restore
+      assert_operator CapNG.snapshot_generation, :>, generation
+
+      generation = CapNG.snapshot_generation
+      assert_equal generation + 1, CapNG.refresh!
+    end
+
+    test "apply refreshes the snapshot" do
+      omit "Needed to run as root" unless Process.uid == 0
+      assert_true(in_child do
+        capng = CapNG.new(:current_process)
+        held = CapNG.current_capability?(:effective, :net_raw)
+        capng.update(:drop, :effective, :net_raw)
+        capng.apply(:caps)
+        held && !CapNG.current_capability?(:effective, :net_raw) &&
+          !CapNG.new(:current_process).have_capability?(:effective, :net_raw)
+      end)
+    end
+  end
+
+  sub_test_case "Process scan" do
+    test "scans the PID namespace of the given process" do
+      results = CapNG.scan_processes(pids: [Process.pid], threads: 2)
+      own = results.find { |result| result[:pid] == Process.pid }
+      assert_not_nil own
+      assert_equal Process.pid, own[:root]
+      assert_equal File.stat("/proc/self/ns/pid").ino, own[:pid_namespace]
+      assert_equal kernel_capabilities("CapBnd"), own[:bounding]
+      assert_equal File.read("/proc/self/status")[/^CapEff:\s*(\h+)/, 1].to_i(16), own[:effective]
+    end
+
+    test "includes a child process" do
+      pid = spawn("sleep", "10")
+      begin
+        results = CapNG.scan_processes(pids: [Process.pid])
+        assert_true results.any? { |result| result[:pid] == pid }
+      ensure
+        Process.kill(:KILL, pid)
+        Process.wait(pid)
+      end
+    end
+
+    test "reads members from cgroup.procs" do
+      Dir.mktmpdir do |dir|
+        File.write(File.join(dir, "cgroup.procs"), "#{Process.pid}\n")
+        results = CapNG.scan_processes(cgroups: [dir], threads: 1)
+        assert_equal [Process.pid], results.map { |result| result[:pid] }
+        assert_equal dir, results.first[:root]
+      end
+    end
+
+    test "walks descendant cgroups" do
+      Dir.mktmpdir do |dir|
+        leaf = File.join(dir, "pod.slice", "container.scope")
+        FileUtils.mkdir_p(leaf)
+        File.write(File.join(dir, "cgroup.procs"), "")
+        File.write(File.join(dir, "pod.slice", "cgroup.procs"), "")
+        File.write(File.join(leaf, "cgroup.procs"), "#{Process.pid}\n")
+        Dir.mkdir(File.join(dir, "not-a-cgroup"))
+        results = CapNG.scan_processes(cgroups: [dir])
+        assert_equal [[Process.pid, dir]], results.map { |result| [result[:pid], result[:root]] }
+      end
+    end
+
+    test "keeps cgroup paths valid while another thread compacts" do
+      omit "GC.compact is not available" unless GC.respond_to?(:compact)
+      Dir.mktmpdir do |dir|
+        File.write(File.join(dir, "cgroup.procs"), "#{Process.pid}\n")
+        stop = false
+        compactor = Thread.new { GC.compact until stop }
+        begin
+          20.times do
+            results = CapNG.scan_processes(cgroups: [dir.dup], threads: 2)
+            assert_equal [[Process.pid, dir]], results.map { |result| [result[:pid], result[:root]] }
+          end
+        rescue NotImplementedError
+          omit "GC.compact is not supported on this platform"
+        ensure
+          stop = true
+          compactor.join rescue nil
+        end
+      end
+    end
+
+    test "rejects malformed arguments before scanning" do
+      assert_raise(TypeError) do
+        CapNG.scan_processes(pids: [1, "1"])
+      end
+      assert_raise(ArgumentError) do
+        CapNG.scan_processes(cgroups: ["/sys/fs/cgroup\0"])
+      end
+    end
+
+    test "skips processes that have exited" do
+      pid = spawn("true")
+      Process.wait(pid)
+      Dir.mktmpdir do |dir|
+        File.write(File.join(dir, "cgroup.procs"), "#{pid}\n")
+        assert_equal [], CapNG.scan_processes(cgroups: [dir])
+      end
+    end
+
+    test "missing cgroup" do
+      assert_raise(Errno::ENOENT) do
+        CapNG.scan_processes(cgroups: ["/nonexistent/cgroup"])
+      end
+    end
+  end
+
+  sub_test_case "Process enumeration" do
+    test "without a block returns a lazy enumerator" do
+      assert_kind_of Enumerator::Lazy, CapNG.each_process
+    end
+
+    test "filters by capabilities" do
+      own = CapNG.each_process(filter: []).find { |process| process[:pid] == Process.pid }
+      assert_equal kernel_capabilities("CapBnd"), own[:bounding]
+
+      held = CapNG.each_process(filter: :chown, type: :bounding_set).map { |process| process[:bounding] }.to_a
+      assert_true held.all? { |mask| mask & CapNG::Capability.mask(:chown) != 0 }
+      assert_equal [], CapNG.each_process(filter: {mask: 1 << 63}).to_a
+    end
+
+    test "stops reading on break" do
+      count = 0
+      CapNG.each_process do |process|
+        count += 1
+        break
+      end
+      assert_equal 1, count
+      assert_equal 3, CapNG.each_process.first(3).size
+    end
+
+    def proc_directory_fds
+      Dir.children("/proc/self/fd").count do |fd|
+        File.readlink("/proc/self/fd/#{fd}") == "/proc" rescue false
+      end
+    end
+
+    def start_external_enumerator
+      enumerator = CapNG.each_process
+      enumerator.next
+      nil
+    end
+
+    test "closes /proc for an abandoned external enumerator" do
+      before = proc_directory_fds
+      start_external_enumerator
+      3.times { GC.start(full_mark: true, immediate_sweep: true) }
+      assert_equal before, proc_directory_fds
+    end
+
+    test "a capability constant is not a mask" do
+      chown = CapNG.each_process(filter: CapNG::Capability::CHOWN, type: :bounding_set).to_a
+      assert_true chown.all? { |process| process[:bounding] & CapNG::Capability.mask(:chown) != 0 }
+      kill = CapNG.each_process(filter: {mask: CapNG::Capability.mask(:kill)}, type: :bounding_set).to_a
+      assert_true kill.all? { |process| process[:bounding] & CapNG::Capability.mask(:kill) != 0 }
+    end
+
+    test "combined types" do
+      error = assert_raise(ArgumentError) do
+        CapNG.each_process(type: CapNG::Type::EFFECTIVE | CapNG::Type::PERMITTED) {}
+      end
+      assert_match(/single capability type/, error.message)
+    end
+  end
+
+  sub_test_case "Apply to all threads" do
+    test "changes every thread of the process" do
+      omit "Needed to run as root" unless Process.uid == 0
+      assert_true(in_child do
+        queue = Queue.new
+        threads = 3.times.map { Thread.new { queue.pop } }
+        Thread.pass until threads.all?(&:native_thread_id)
+        tids = threads.map(&:native_thread_id)
+        capng = CapNG.new(:current_process)
+        capng.update(:drop, CapNG::Type::EFFECTIVE | CapNG::Type::PERMITTED, :net_raw)
+        result = capng.apply_all_threads(:caps)
+        after = CapNG.thread_capabilities
+        3.times { queue << nil }
+        threads.each(&:join)
+        (tids + [Process.pid] - result.keys).empty? &&
+          result.values.uniq == [:ok] &&
+          after.all? { |entry| entry[:permitted] & CapNG::Capability.mask(:net_raw) == 0 } &&
+          after.none? { |entry| entry[:diverged] }
+      end)
+    end
+
+    test "reports failures per thread" do
+      omit "Needed to run as root" unless Process.uid == 0
+      assert_true(in_child do
+        capng = CapNG.new(:current_process)
+        capng.update(:drop, CapNG::Type::EFFECTIVE | CapNG::Type::PERMITTED, :net_raw)
+        capng.apply_all_threads(:caps)
+        capng.update(:add, :permitted, :net_raw)
+        result = capng.apply_all_threads
+        result[Process.pid] == :eperm
+      end)
+    end
+
+    test "leaves a signal handled by somebody else alone" do
+      # A fresh process, as the handler stays installed once used.
+      script = <<~RUBY
+        require "capng"
+        require "fiddle"
+        libc = Fiddle::Handle::DEFAULT
+        sigrtmax = Fiddle::Function.new(libc["__libc_current_sigrtmax"], [], Fiddle::TYPE_INT).call
+        signal = Fiddle::Function.new(libc["signal"], [Fiddle::TYPE_INT, Fiddle::TYPE_VOIDP],
+                                      Fiddle::TYPE_VOIDP)
+        signal.call(sigrtmax - 2, libc["getpid"])
+        begin
+          CapNG.apply_all_threads
+          exit!(1)
+        rescue RuntimeError => e
+          exit!(e.message.include?("already has a handler") ? 0 : 2)
+        end
+      RUBY
+      assert_true system(RbConfig.ruby, "-I", File.expand_path("../lib", __dir__), "-e", script)
+    end
+  end
+
+  sub_test_case "Trace" do
+    teardown do
+      CapNG.trace_disable
+      CapNG.trace_clear
+    end
+
+    test "records nothing unless enabled" do
+      CapNG.trace_clear
+      CapNG.new.update(:add, :effective, :chown)
+      assert_false CapNG.trace_enabled?
+      assert_equal [], CapNG.trace_dump
+    end
+
+    test "records state-changing calls in order" do
+      CapNG.trace_clear
+      CapNG.trace_enable
+      capng = CapNG.new
+      capng.clear(:caps)
+      capng.update(:add, :permitted, :net_raw)
+      state = CapNG::State.new
+      state.save
+      state.restore
+      CapNG.trace_disable
+
+      entries = CapNG.trace_dump
+      assert_equal [:clear, :update, :state_restore], entries.map { |entry| entry[:operation] }
+      update = entries[1]
+      assert_equal [
+                     [CapNG::Action::ADD, CapNG::Type::PERMITTED, 0],
+                     [CapNG::Capability.mask(:net_raw), 0],
+                     0,
+                     Thread.current.native_thread_id,
+                   ],
+                   [update[:args], update[:masks], update[:result], update[:tid]]
+      assert_equal [0, CapNG::Capability.mask(:net_raw)], entries[2][:masks]
+      assert_equal entries.map { |entry| entry[:sequence] }.sort, entries.map { |entry| entry[:sequence] }
+      assert_kind_of Time, update[:time]
+    end
+
+    test "keeps only the latest entries" do
+      CapNG.trace_clear
+      CapNG.trace_enable
+      capng = CapNG.new
+      1500.times { capng.update(:add, :effective, :chown) }
+      CapNG.trace_disable
+      entries = CapNG.trace_dump
+      assert_equal 1024, entries.size
+      assert_equal 1023, entries.last[:sequence] - entries.first[:sequence]
+    end
+
+    test "records failures with errno" do
+      omit "Needed to run as root" unless Process.uid == 0
+      assert_true(in_child do
+        CapNG.trace_enable
+        capng = CapNG.new(:current_process)
+        capng.update(:drop, CapNG::Type::EFFECTIVE | CapNG::Type::PERMITTED, :net_raw)
+        capng.apply(:caps)
+        capng.update(:add, :permitted, :net_raw)
+        capng.apply(:caps)
+        applies = CapNG.trace_dump.select { |entry| entry[:operation] == :apply }
+        applies.map { |entry| [entry[:result] == 0, entry[:errno]] } == [[true, 0], [false, Errno::EPERM::Errno]]
+      end)
+    end
+  end
+
+  sub_test_case "Thread capabilities" do
+    test "reads every thread of the current process" do
+      queue = Queue.new
+      thread = Thread.new { queue.pop }
+      Thread.pass until thread.native_thread_id
+      threads = CapNG.thread_capabilities
+      tids = threads.map { |entry| entry[:tid] }
+      assert_include tids, Process.pid
+      assert_include tids, thread.native_thread_id
+      leader = threads.find { |entry| entry[:tid] == Process.pid }
+      assert_equal [kernel_capabilities("CapEff"), false],
+                   [leader[:effective], leader[:diverged]]
+    ensure
+      queue << nil
+      thread.join
+    end
+
+    test "flags threads which changed their own capabilities" do
+      omit "Needed to run as root" unless Process.uid == 0
+      assert_true(in_child do
+        dropped = Queue.new
+        done = Queue.new
+        thread = Thread.new do
+          capng = CapNG.new(:current_process)
+          capng.update(:drop, :effective, :net_raw)
+          capng.apply(:caps)
+          dropped << true
+          done.pop
+        end
+        dropped.pop
+        tid = thread.native_thread_id
+        threads = CapNG.thread_capabilities(Process.pid)
+        done << true
+        thread.join
+        diverged = threads.select { |entry| entry[:diverged] }
+        diverged.map { |entry| entry[:tid] } == [tid] &&
+          diverged.first[:effective] & CapNG::Capability.mask(:net_raw) == 0
+      end)
+    end
+
+    test "unknown process" do
+      assert_raise(Errno::ENOENT) do
+        CapNG.thread_capabilities(2**22 + 1)
+      end
+    end
+  end
+
+  sub_test_case "Audit" do
+    test "streams a process record per line" do
+      io = StringIO.new
+      count = CapNG.audit(io)
+      lines = io.string.lines
+      assert_equal count, lines.size
+      own = lines.map { |line| JSON.parse(line) }.find { |record| record["pid"] == Process.pid }
+      assert_equal "process", own["type"]
+      assert_equal Process.uid, own["uid"]
+      assert_equal kernel_capabilities("CapBnd"), own["bounding"]
+      assert_equal CapNG::Print.new.caps_text(:buffer, :bounding_set).split(", ").sort,
+                   own["bounding_names"].sort
+    end
+
+    test "writes through a bounded buffer" do
+      io = Object.new
+      writes = []
+      io.define_singleton_method(:write) { |str| writes << str.bytesize; str.bytesize }
+      CapNG.audit(io, buffer_size: 4096)
+      assert_operator writes.size, :>, 1 if writes.sum > 4096
+      assert_true writes.all? { |size| size <= 4096 }
+    end
+
+    test "writers may keep the written Strings" do
+      io = Object.new
+      kept = []
+      io.define_singleton_method(:write) { |str| kept << str; str.bytesize }
+      count = CapNG.audit(io, buffer_size: 4096)
+      lines = kept.join.lines
+      assert_equal count, lines.size
+      assert_true lines.all? { |line| JSON.parse(line)["type"] == "process" }
+    end
+
+    test "file capabilities under a path" do
+      omit "Needed to run as root" unless Process.uid == 0
+      Dir.mktmpdir do |dir|
+        Dir.mkdir(File.join(dir, "bin"))
+        path = File.join(dir, "bin", "tool\"quoted")
+        File.write(path, "")
+        File.write(File.join(dir, "plain"), "")
+        data = [0x02000001, 1 << 13, 0, 0, 0].pack("V*")
+        omit "security.capability is not supported" unless set_file_capabilities(path, data)
+
+        io = StringIO.new
+        assert_equal 1, CapNG.audit(io, processes: false, paths: [dir])
+        record = JSON.parse(io.string)
+        assert_equal "file", record["type"]
+        assert_equal path, record["path"]
+        assert_equal File.stat(path).ino, record["inode"]
+        assert_equal 2, record["version"]
+        assert_true record["effective"]
+        assert_equal ["net_raw"], record["permitted_names"]
+        assert_true record.key?("rootid")
+        assert_nil record["rootid"]
+      end
+    end
+  end
+
+  sub_test_case "Module-level functions" do
+    test "share the per-thread state with instances" do
+      CapNG.clear(:both)
+      assert_true CapNG.update(:add, :effective, :chown)
+      assert_true CapNG.have_capability?(:effective, :chown)
+      assert_true @capng.have_capability?(:effective, :chown)
+      assert_equal [true, true], CapNG.update(:add, :permitted, [:chown, :kill])
+      assert_equal CapNG::Capability.mask(:chown, :kill), CapNG.capabilities_mask(:permitted)
+      assert_equal CapNG::Result::PARTIAL, CapNG.have_capabilities?(:caps)
+    end
+
+    test "capability and print" do
+      assert_equal CapNG::Capability::CHOWN, CapNG::Capability.from_name(:chown)
+      assert_equal "chown", CapNG::Capability.to_name(CapNG::Capability::CHOWN)
+      CapNG.clear(:both)
+      CapNG.update(:add, :effective, :chown)
+      assert_equal "chown", CapNG::Print.caps_text(:buffer, :effective)
+    end
+
+    test "caps_file" do
+      Tempfile.create("capng") do |file|
+        assert_false CapNG.caps_file(file.path)
+      end
+    end
+  end
+
+  sub_test_case "Status queries" do
+    test "caps_file_status" do
+      Tempfile.create("capng") do |file|
+        assert_equal :no_caps, CapNG.caps_file_status(file.path)
+        assert_equal :no_caps, @capng.caps_file_status(file)
+      end
+      assert_equal :enoent, CapNG.caps_file_status("/nonexistent/capng")
+    end
+
+    test "caps_file_status with file capabilities" do
+      omit "Needed to run as root" unless Process.uid == 0
+      Tempfile.create("capng") do |file|
+        data = [0x02000001, 1 << 13, 0, 0, 0].pack("V*")
+        omit "security.capability is not supported" unless set_file_capabilities(file.path, data)
+        assert_equal :ok, CapNG.caps_file_status(file.path)
+        assert_true CapNG.have_capability?(:permitted, :net_raw)
+      end
+    end
+
+    test "caps_file_status without permission" do
+      omit "Needed to run as root" unless Process.uid == 0
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, "secret")
+        File.write(path, "")
+        File.chmod(0o700, dir)
+        assert_true(in_child do
+          Process::Sys.setuid(65534)
+          CapNG.caps_file_status(path) == :eacces
+        end)
+      end
+    end
+
+    test "caps_process_status" do
+      assert_equal :ok, CapNG.caps_process_status(Process.pid)
+      pid = spawn("true")
+      Process.wait(pid)
+      assert_equal :esrch, CapNG.caps_process_status(pid)
+    end
+  end
+
+  sub_test_case "File capability" do
+    test "file without capabilities" do
+      Tempfile.create("capng") do |file|
+        assert_nil CapNG.file_caps(file.path)
+      end
+      assert_raise(Errno::ENOENT) do
+        CapNG.file_caps("/nonexistent/capng")
+      end
+    end
+
+    test "decodes the attribute" do
+      omit "Needed to run as root" unless Process.uid == 0
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, "tool")
+        File.write(path, "")
+        data = [0x02000001, 1 << 13, 1 << 0, 0, 0].pack("V*")
+        omit "security.capability is not supported" unless set_file_capabilities(path, data)
+
+        @capng.clear(:both)
+        caps = CapNG.file_caps(path)
+        assert_true caps.frozen?
+        assert_equal 2, caps.version
+        assert_true caps.effective?
+        assert_equal CapNG::Capability.mask(:net_raw), caps.permitted
+        assert_equal CapNG::Capability.mask(:chown), caps.inheritable
+        assert_nil caps.rootid
+        assert_true caps.permitted?(:net_raw)
+        assert_false caps.permitted?([:net_raw, :chown])
+        assert_equal ["net_raw"], caps.permitted_names
+        assert_equal ["chown"], caps.inheritable_names
+        assert_equal({version: 2, effective: true, permitted: 1 << 13, inheritable: 1, rootid: nil},
+                     caps.to_h)
+        # libcap-ng's state is left alone
+        assert_false @capng.have_capability?(:permitted, :net_raw)
+
+        link = File.join(dir, "link")
+        File.symlink(path, link)
+        assert_equal caps, CapNG.file_caps(link)
+        assert_true caps.eql?(CapNG.file_caps(link))
+        assert_equal caps.hash, CapNG.file_caps(link).hash
+        assert_equal [caps], [caps, CapNG.file_caps(link)].uniq
+        assert_equal 1, {caps => 1, CapNG.file_caps(link) => 2}.size
+        assert_nil CapNG.file_caps(link, follow_symlinks: false)
+      end
+    end
+
+    test "no public constructor" do
+      assert_raise(NoMethodError, TypeError) do
+        CapNG::FileCapability.new
+      end
+    end
+  end
+
+  sub_test_case "Policy" do
+    test "compile resolves masks once" do
+      policy = CapNG::Policy.compile(effective: [:chown, :kill],
+                                     permitted: {mask: CapNG::Capability.mask(:chown, :kill, :net_raw)})
+      assert_true policy.frozen?
+      assert_equal CapNG::Capability.mask(:chown, :kill), policy.effective
+      assert_equal CapNG::Capability.mask(:chown, :kill, :net_raw), policy.permitted
+      assert_nil policy.bounding
+      assert_raise(ArgumentError) do
+        CapNG::Policy.compile(effective: [:chown], unknown: [:kill])
+      end
+      assert_raise(RuntimeError) do
+        CapNG::Policy.compile(effective: [:no_such_capability])
+      end
+    end
+
+    test "compile treats a bare Integer as a capability constant" do
+      policy = CapNG::Policy.compile(effective: CapNG::Capability::NET_RAW,
+                                     permitted: {mask: CapNG::Capability.mask(:net_raw)})
+      assert_equal CapNG::Capability.mask(:net_raw), policy.effective
+      assert_equal policy.effective, policy.permitted
+      assert_raise(ArgumentError) do
+        CapNG::Policy.compile(effective: {mask: "0"})
+      end
+    end
+
+    test "check against the calling thread" do
+      held = kernel_capabilities("CapEff")
+      assert_true CapNG::Policy.compile(effective: {mask: held}).check
+      assert_true CapNG::Policy.compile(bounding: {mask: kernel_capabilities("CapBnd")}).check
+      assert_false CapNG::Policy.compile(effective: {mask: held | (1 << 62)}).check
+    end
+
+    test "apply" do
+      omit "Needed to run as root" unless Process.uid == 0
+      assert_true(in_child do
+        policy = CapNG::Policy.compile(effective: [:chown],
+                                       permitted: [:chown, :net_raw])
+        bounding = kernel_capabilities("CapBnd")
+        policy.apply && policy.check &&
+          kernel_capabilities("CapEff") == CapNG::Capability.mask(:chown) &&
+          kernel_capabilities("CapPrm") == CapNG::Capability.mask(:chown, :net_raw) &&
+          kernel_capabilities("CapBnd") == bounding &&
+          policy.apply
+      end)
+    end
+
+    test "apply_to_file" do
+      omit "Needed to run as root" unless Process.uid == 0
+      Tempfile.create("capng") do |file|
+        policy = CapNG::Policy.compile(effective: [:net_raw], permitted: [:net_raw])
+        @capng.clear(:both)
+        @capng.update(:add, :effective, :kill)
+        omit "security.capability is not supported" unless policy.apply_to_file(file.path)
+        caps = CapNG.file_caps(file.path)
+        assert_true caps.effective?
+        assert_equal CapNG::Capability.mask(:net_raw), caps.permitted
+        assert_true @capng.have_capability?(:effective, :kill)
+        assert_false @capng.have_capability?(:effective, :net_raw)
+      end
+    end
+  end
+
+  sub_test_case "GC integration" do
+    test "memsize of a saved state" do
+      require "objspace"
+      state = CapNG::State.new
+      empty = ObjectSpace.memsize_of(state)
+      state.save
+      assert_operator ObjectSpace.memsize_of(state), :>, empty
+      state.restore
+      assert_equal empty, ObjectSpace.memsize_of(state)
+    end
+
+    test "objects survive compaction" do
+      omit "GC.compact is not available" unless GC.respond_to?(:compact)
+      state = CapNG::State.new
+      state.save
+      handoff = CapNG::AmbientHandoff.new(:chown)
+      begin
+        GC.compact
+      rescue NotImplementedError
+        omit "GC.compact is not supported on this platform"
+      end
+      assert_equal CapNG::Capability.mask(:chown), handoff.mask
+      assert_nothing_raised { state.restore }
+      assert_equal CapNG::Capability::CHOWN, CapNG::Capability.new.from_name(:chown)
+      assert_kind_of String, CapNG::Print.new.caps_text(:buffer, :effective)
+    end
+  end
+
   sub_test_case "Print" do
     test "print operations" do
       @print = CapNG::Print.new
@@ -164,6 +1395,43 @@ class CapNGTest < ::Test::Unit::TestCase
     end
   end
 
+  sub_test_case "Print cache" do
+    test "repeated sets share a frozen String" do
+      CapNG.clear(:both)
+      CapNG.update(:add, :effective, [:chown, :kill])
+      text = CapNG::Print.caps_text(:buffer, :effective)
+      assert_equal "chown, kill", text
+      assert_true text.frozen?
+      assert_same text, CapNG::Print.new.caps_text(:buffer, :effective)
+
+      CapNG.update(:add, :permitted, [:chown, :kill])
+      assert_equal text, CapNG::Print.caps_text(:buffer, :permitted)
+      assert_not_same text, CapNG::Print.caps_text(:buffer, :permitted)
+
+      CapNG.update(:drop, :effective, :kill)
+      assert_equal "chown", CapNG::Print.caps_text(:buffer, :effective)
+      CapNG.clear(:both)
+      assert_equal "none", CapNG::Print.caps_text(:buffer, :effective)
+    end
+
+    test "evicts the least recently used set" do
+      render = lambda do |caps|
+        CapNG.clear(:both)
+        CapNG.update(:add, :effective, caps)
+        CapNG::Print.caps_text(:buffer, :effective)
+      end
+      kept = render.call([:chown])
+      stale = render.call([:kill])
+      codes = CapNG::Capability.new.each.map { |code, _name| code }.first(12)
+      codes.combination(2).first(66).each_with_index do |pair, i|
+        render.call(pair)
+        render.call([:chown]) if i % 8 == 0
+      end
+      assert_same kept, render.call([:chown])
+      assert_not_same stale, render.call([:kill])
+    end
+  end
+
   sub_test_case "Process operation" do
     sub_test_case "w/o initialize args" do
       test "current process" do